@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstring>
 #include <string>
 
@@ -10,6 +11,7 @@
 Client::Client(std::shared_ptr<Logger> &logger, const char *sip, unsigned short sport)
 : m_clientSocketFd(-1), m_pLogger(logger)
 {
+    m_reactor.addBeforeSleepProc(std::bind(&Client::flushDirtyConns, this));
     if (sip == nullptr)
     {
         return;
@@ -24,13 +26,16 @@ Client::~Client()
     m_reactor.stopEventLoop();
     if (m_clientSocketFd != -1)
     {
+        m_reactor.cancelSend(m_clientSocketFd);
         close(m_clientSocketFd);
         m_reactor.removeFileEvent(m_clientSocketFd, EVENT_READABLE | EVENT_WRITABLE);
     }
 
-    for (const auto &it : m_mapLocalConn)
+    for (auto &it : m_mapLocalConn)
     {
+        closeLocalData(it.second);
         m_reactor.removeFileEvent(it.first, EVENT_READABLE | EVENT_WRITABLE);
+        m_reactor.cancelSend(it.first);
         close(it.first);
     }
 
@@ -52,8 +57,18 @@ int Client::sendAuthPassword()
 {
     int ret, sendCnt = 0;
 
-    uint8_t buf[MsgUtil::ensureEncryptedDataSize(PW_MAX_LEN)];
-    uint32_t dataLen = MsgUtil::packEncryptedData(m_pCryptor, buf, (uint8_t *) m_password, PW_MAX_LEN);
+    AuthRequestMsg request;
+    memcpy(request.password, m_password, PW_MAX_LEN);
+    request.cryptMethods = 1 << CRYPT_CHACHA20_POLY1305;
+    request.frameVersion = FRAME_VERSION_LATEST;
+    request.dataMode = m_isPassthrough ? DATA_MODE_SPLICE : DATA_MODE_TUNNEL;
+    if (Cryptor::isSupported(CRYPT_GCM))
+    {
+        request.cryptMethods |= 1 << CRYPT_GCM;
+    }
+
+    uint8_t buf[MsgUtil::ensureEncryptedDataSize(sizeof(request))];
+    uint32_t dataLen = MsgUtil::packEncryptedData(m_pCryptor, buf, (uint8_t *) &request, sizeof(request));
 
     while (true)
     {
@@ -95,27 +110,54 @@ int Client::checkAuthResult()
         
         if (ret == static_cast<int>(targetSize))
         {
-            if (targetSize == sizeof(DataHeader))
+            if (header.dataLen == 0)
             {
                 memcpy(&header, recvBuf, targetSize);
+                if (header.dataLen > sizeof(recvBuf))
+                {
+                    printf("authServer reply too long: %u\n", header.dataLen);
+                    m_pLogger->err("authServer reply too long: %u", header.dataLen);
+                    return AUTH_UNKNOWN;
+                }
             }
             else
             {
-                // shoud be sizeof(AUTH_TOKEN), if password is wrong, this value is a random number
-                m_pCryptor->decrypt(
+                // can't be decrypted if the password is wrong
+                uint32_t replySize = m_pCryptor->decrypt(
                     header.iv,
                     recvBuf,
                     targetSize
                 );
+                if (replySize == DECRYPT_ERR || replySize < sizeof(AUTH_TOKEN)
+                    || memcmp(AUTH_TOKEN, recvBuf, sizeof(AUTH_TOKEN)))
+                {
+                    return AUTH_WRONG;
+                }
 
-                if (!memcmp(AUTH_TOKEN, recvBuf, sizeof(AUTH_TOKEN)))
+                // old servers reply the token only, they speak cbc
+                AuthReplyMsg reply{};
+                memcpy(&reply, recvBuf, std::min(static_cast<size_t>(replySize), sizeof(reply)));
+                CRYPT_METHOD method = static_cast<CRYPT_METHOD>(reply.cryptMethod);
+                if (method != CRYPT_CBC && Cryptor::isSupported(method))
                 {
-                    return AUTH_OK;
+                    m_pCryptor = std::make_unique<Cryptor>(method, (uint8_t*)m_password);
                 }
-                else
+                // they read one message per record too, and the old encoding of messages
+                m_clientData.frameVersion = std::min<uint8_t>(reply.frameVersion, FRAME_VERSION_LATEST);
+                for (FrameBatcher *batcher : {&m_clientData.ctrlBatcher, &m_clientData.batcher})
                 {
-                    return AUTH_WRONG;
+                    batcher->setBatching(replySize > sizeof(AUTH_TOKEN));
+                    batcher->setFrameVersion(m_clientData.frameVersion);
+                }
+                m_dataMode = reply.dataMode == DATA_MODE_SPLICE ? DATA_MODE_SPLICE : DATA_MODE_TUNNEL;
+                memcpy(m_sessionToken, reply.sessionToken, sizeof(m_sessionToken));
+                if (m_isPassthrough && m_dataMode != DATA_MODE_SPLICE)
+                {
+                    printf("server has no cipher = none, user data goes through the tunnel\n");
+                    m_pLogger->warn("server has no cipher = none, user data goes through the tunnel");
                 }
+                printf("record crypt method: %d\n", m_pCryptor->method());
+                return AUTH_OK;
             }
         }
         else if (ret == -1)
@@ -142,8 +184,8 @@ int Client::checkAuthResult()
 
 /*
  * 认证过程：
- * client->server: md5(password), len=32bytes
- * server->client: Y/N, len=1byte
+ * client->server: md5(password) + 支持的加密方式 + 消息编码, len=34bytes
+ * server->client: AUTH_TOKEN + 之后记录的加密方式 + 消息编码
  * return: -1: err, 0: ok, 1: wrong password
  */
 int Client::authServer()
@@ -165,14 +207,17 @@ int Client::sendPorts()
         return 0;
     }
 
-    unsigned short ports[portNum + 1]; // [0]: 存放端口的数量，之后存放端口
+    // [0]: 存放端口的数量，之后存放端口, 新的服务端还要每个端口的权重
+    bool hasWeights = m_clientData.frameVersion >= FRAME_VERSION_VARINT;
+    unsigned short ports[2 * portNum + 1];
     ports[0] = (unsigned short)portNum;
     for (size_t i = 0; i < portNum; i++)
     {
         ports[i + 1] = m_configProxy[i].remotePort;
+        ports[i + 1 + portNum] = m_configProxy[i].weight;
     }
 
-    size_t dataSize = sizeof(ports);
+    size_t dataSize = (hasWeights ? 2 * portNum + 1 : portNum + 1) * sizeof(unsigned short);
     uint8_t buf[MsgUtil::ensureEncryptedDataSize(dataSize)];
     uint32_t cryptedDataLen = MsgUtil::packEncryptedData(m_pCryptor, buf, (uint8_t *) ports, dataSize);
 
@@ -200,12 +245,16 @@ int Client::sendPorts()
 }
 
 // send data to server
-void Client::serverSafeRecv(int sfd, const std::function<void(size_t dataSize)>& callback)
+int Client::serverSafeRecv(int sfd, const std::function<void(size_t dataSize)>& callback)
 {
     int ret;
     size_t targetSize = m_clientData.header.ensureTargetDataSize();
+    if (!m_clientData.recvBuf)
+    {
+        m_clientData.recvBuf = acquireChunk();
+    }
 
-    ret = recv(sfd, m_clientData.recvBuf + m_clientData.recvNum,
+    ret = recv(sfd, m_clientData.recvBuf->data + m_clientData.recvNum,
                 targetSize - m_clientData.recvNum, MSG_DONTWAIT);
     
     if (ret == -1)
@@ -214,141 +263,351 @@ void Client::serverSafeRecv(int sfd, const std::function<void(size_t dataSize)>&
         {
             printf("serverSafeRecv err: %d\n", errno);
             m_pLogger->err("serverSafeRecv err: %d", errno);
-            return;
         }
+        else if (m_clientData.recvNum == 0 && m_clientData.header.dataLen == 0)
+        {
+            m_clientData.recvBuf.reset(); // nothing half received, give the chunk back
+        }
+        return -1;
     }
     else if (ret == 0)
     {
         printf("clientReadProc server offline\n");
         m_pLogger->info("clientReadProc server offline");
         stopClient();
+        return 0;
     }
-    else if (ret > 0)
-    {
-        m_clientData.recvNum += ret;
 
-        if (m_clientData.recvNum == targetSize)
+    m_clientData.recvNum += ret;
+    if (m_clientData.recvNum == targetSize)
+    {
+        m_clientData.recvNum = 0;
+        
+        if (m_clientData.header.dataLen == 0) // a record may be as long as a header
         {
-            m_clientData.recvNum = 0;
-            
-            if (targetSize == sizeof(DataHeader))
+            memcpy(&m_clientData.header, m_clientData.recvBuf->data, targetSize);
+            if (!MsgUtil::isValidRecordSize(m_clientData.header.dataLen))
             {
-                memcpy(&m_clientData.header, m_clientData.recvBuf, targetSize);
+                printf("bad record size from server: %u\n", m_clientData.header.dataLen);
+                m_pLogger->err("bad record size from server: %u", m_clientData.header.dataLen);
+                stopClient();
+                return 0;
             }
-            else
+        }
+        else
+        {
+            uint32_t realDataSize = m_pCryptor->decrypt(
+                m_clientData.header.iv, 
+                (uint8_t*)m_clientData.recvBuf->data, 
+                targetSize
+            );
+            if (realDataSize == DECRYPT_ERR)
             {
-                uint32_t realDataSize = m_pCryptor->decrypt(
-                    m_clientData.header.iv, 
-                    (uint8_t*)m_clientData.recvBuf, 
-                    targetSize
-                );
+                printf("bad record from server\n");
+                m_pLogger->err("bad record from server");
+                stopClient();
+                return 0;
+            }
 
-                // if recv all done, we callback
-                callback(realDataSize);
+            // if recv all done, we callback
+            callback(realDataSize);
 
-                // remember init datalen for next recv
-                m_clientData.header.dataLen = 0;
-            }
+            // remember init datalen for next recv
+            m_clientData.header.dataLen = 0;
         }
     }
+    return ret;
 }
 
-// 先加密，在把数据放到m_clientData.sendBuf+m_clientData.sendSize的位置即可
+// 先加密，在把数据放到m_clientData.sendQueue的末尾即可
 void Client::serverSafeSend(int fd, const std::function<void(int fd)>& callback)
 {
-    int ret = send(fd, &m_clientData.sendBuf, m_clientData.sendSize, MSG_DONTWAIT);
+    size_t budget = READ_BUDGET_PER_EVENT;
+    bool isSocketFull = false;
+    while (!isSocketFull)
+    {
+        // the local conns take their turns, then the frames queued since the last flush go as one record
+        budget -= std::min(scheduleLocalReads(budget), budget);
+        m_clientData.ctrlBatcher.seal(m_pCryptor, m_clientData.sendQueue);
+        m_clientData.batcher.seal(m_pCryptor, m_clientData.sendQueue);
+        if (m_clientData.sendQueue.empty())
+        {
+            break;
+        }
 
-    if (ret == -1)
+        struct iovec iov[MAX_WRITE_IOVS];
+        size_t len;
+        int iovCnt = m_clientData.sendQueue.peek(iov, MAX_WRITE_IOVS, &len);
+        int ret = tnet::send_iov(fd, iov, iovCnt);
+        if (ret == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("serverSafeSend err: %d\n", errno);
+                m_pLogger->err("serverSafeSend err: %d\n", errno);
+            }
+            isSocketFull = true;
+            break;
+        }
+
+        m_clientData.sendQueue.consume(ret);
+        isSocketFull = static_cast<size_t>(ret) < len;
+    }
+
+    m_clientData.isSocketFull = isSocketFull;
+    if (!m_clientData.activeConns.empty())
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        if (!isSocketFull)
         {
-            printf("serverSafeSend err: %d\n", errno);
-            m_pLogger->err("serverSafeSend err: %d\n", errno);
+            // the budget is used up, the round goes on in next loop
+            m_reactor.activateFileEvent(fd, EVENT_WRITABLE);
         }
     }
-    else if (ret > 0)
+    else if (m_clientData.sendQueue.empty())
     {
-        m_clientData.sendSize -= ret;
+        callback(fd);
+    }
+}
 
-        if (m_clientData.sendSize == 0)
+void Client::clientReadProc(int fd, int mask)
+{
+    if (!(mask & EVENT_READABLE))
+    {
+        return;
+    }
+
+    auto callback = std::bind(
+        &Client::onClientReadDone,
+        this,
+        std::placeholders::_1
+    );
+
+    // read records until EAGAIN, go on in next loop if the budget is used up
+    size_t budget = 0;
+    int ret = 0;
+    while (budget < READ_BUDGET_PER_EVENT)
+    {
+        ret = serverSafeRecv(fd, callback);
+        if (ret <= 0)
         {
-            callback(fd);
+            break;
         }
-        else
+        budget += ret;
+    }
+
+    // not when the server is gone or sent a bad record
+    if (ret > 0 && !m_reactor.isStopped())
+    {
+        m_reactor.activateFileEvent(fd, EVENT_READABLE);
+    }
+}
+
+void Client::onClientReadDone(size_t dataSize)
+{
+    // a record carries one or more messages. the local conns its data goes to keep a
+    // reference of it instead of a copy, the next record is received into a new chunk
+    SharedChunk record(std::move(m_clientData.recvBuf));
+    size_t offset = 0;
+    while (offset < dataSize)
+    {
+        Frame frame;
+        size_t frameSize;
+        if (!FrameCodec::decode(m_clientData.frameVersion, record->data + offset, dataSize - offset, &frame,
+                                &frameSize))
         {
-            printf("+++++++++++++++++++++++++++++!\n");
-            memmove(
-                m_clientData.sendBuf, 
-                m_clientData.sendBuf + ret, 
-                m_clientData.sendSize
-            );
+            printf("bad message in record from server\n");
+            m_pLogger->err("bad message in record from server");
+            stopClient();
+            return;
+        }
+
+        // messages of unknown types are skipped, so are those of users closed here while they were on the way
+        frame.record = &record;
+        bool isStreamGone = MsgUtil::isStreamMsg(frame.type) && !hasLocalConn(frame.streamId);
+        if (!isStreamGone && frame.type > 0 && frame.type < MSGTYPE_COUNT
+            && s_serverFrameHandlers[frame.type] != nullptr)
+        {
+            (this->*s_serverFrameHandlers[frame.type])(frame);
         }
+        offset += frameSize;
     }
 }
 
-void Client::clientReadProc(int fd, int mask)
+// the messages a server may send, by MSGTYPE
+const Client::ServerFrameHandler Client::s_serverFrameHandlers[MSGTYPE_COUNT] = {
+    nullptr,
+    &Client::onHeartbeatFrame,   // MSGTYPE_HEARTBEAT
+    &Client::onNewProxyFrame,    // MSGTYPE_NEW_PROXY
+    nullptr,                     // MSGTYPE_REPLY_NEW_PROXY
+    &Client::onAppDataFrame,     // MSGTYPE_CLIENT_APP_DATA
+    nullptr,                     // MSGTYPE_LOCAL_DOWN
+    &Client::onUserDownFrame,    // MSGTYPE_USER_DOWN
+    &Client::onWindowUpdateFrame // MSGTYPE_WINDOW_UPDATE
+};
+
+void Client::onHeartbeatFrame(const Frame &frame)
 {
-    if (!(mask & EVENT_READABLE))
+    if (frame.size == strlen(HEARTBEAT_SERVER_MSG)
+        && memcmp(frame.data, HEARTBEAT_SERVER_MSG, frame.size) == 0)
     {
+        processHeartbeat();
+    }
+}
+
+void Client::onNewProxyFrame(const Frame &frame)
+{
+    NewProxyMsg newProxy = {0};
+    if (!FrameCodec::decodeNewProxy(frame, &newProxy))
+    {
+        return;
+    }
+
+    printf("new proxy %d %d\n", newProxy.userId, newProxy.remotePort);
+    m_pLogger->info("new proxy %d %d", newProxy.userId, newProxy.remotePort);
+
+    makeNewProxy(newProxy);
+}
+
+void Client::onAppDataFrame(const Frame &frame)
+{
+    int ufd = frame.streamId;
+    int localFd = m_mapUsers[ufd].localFd;
+
+    // only when the server ignores the window of this user
+    if (m_mapLocalConn[localFd].isSendBufFull())
+    {
+        tellServerLocalDown(localFd);
+        deleteLocalConn(localFd);
+        m_pLogger->err("local: %d send buf is full!", localFd);
         return;
     }
 
-    serverSafeRecv(
-        fd,
+    bool isQueueEmpty = m_mapLocalConn[localFd].sendBuf.empty();
+    m_mapLocalConn[localFd].sendBuf.append(*frame.record, frame.data, frame.size);
+
+    // written in one sendmsg at the end of the loop with the data of the other records, like the users on the server
+    if (isQueueEmpty)
+    {
+        markLocalDirty(localFd);
+    }
+}
+
+void Client::onUserDownFrame(const Frame &frame)
+{
+    deleteLocalConn(m_mapUsers[frame.streamId].localFd);
+}
+
+void Client::onWindowUpdateFrame(const Frame &frame)
+{
+    WindowUpdateMsg wum = {0};
+    if (FrameCodec::decodeWindowUpdate(frame, &wum))
+    {
+        processWindowUpdate(frame.streamId, wum);
+    }
+}
+
+void Client::addServerFrame(int type, uint32_t streamId, const void *data, size_t size)
+{
+    FrameBatcher &batcher = MsgUtil::isControlMsg(type) ? m_clientData.ctrlBatcher : m_clientData.batcher;
+    batcher.add(m_pCryptor, m_clientData.sendQueue, type, streamId, data, size);
+    m_clientData.isDirty = true;
+}
+
+// like Server::flushClient
+void Client::flushServer()
+{
+    if (m_reactor.canSubmitSend())
+    {
+        sendServerAsync();
+        return;
+    }
+    m_reactor.registerFileEvent(
+        m_clientSocketFd,
+        EVENT_WRITABLE,
         std::bind(
-            &Client::onClientReadDone,
+            &Client::sendLocalDataProc,
             this,
-            std::placeholders::_1
+            std::placeholders::_1,
+            std::placeholders::_2
         )
     );
+    if (!m_clientData.isSocketFull)
+    {
+        sendLocalDataProc(m_clientSocketFd, EVENT_WRITABLE);
+    }
 }
 
-void Client::onClientReadDone(size_t dataSize)
+// like Server::sendClientAsync
+void Client::sendServerAsync()
 {
-    MsgData msgData;
+    scheduleLocalReads(READ_BUDGET_PER_EVENT);
+    m_clientData.ctrlBatcher.seal(m_pCryptor, m_clientData.sendQueue);
+    m_clientData.batcher.seal(m_pCryptor, m_clientData.sendQueue);
+    if (m_clientData.inFlight > 0 || m_clientData.sendQueue.empty())
+    {
+        return;
+    }
 
-    memcpy(&msgData, m_clientData.recvBuf, sizeof(MsgData));
+    ChainBuffer buf;
+    m_clientData.sendQueue.takeAll(buf);
+    m_clientData.inFlight = buf.size();
+    m_reactor.submitSend(m_clientSocketFd, std::move(buf),
+                         std::bind(&Client::onServerSendDone,
+                                   this, std::placeholders::_1, std::placeholders::_2));
+}
 
-    if (msgData.type == MSGTYPE_HEARTBEAT)
+void Client::onServerSendDone(int fd, ssize_t res)
+{
+    if (res < 0)
     {
-        if (memcmp(m_clientData.recvBuf + sizeof(MsgData), 
-                    HEARTBEAT_SERVER_MSG, msgData.size) == 0)
-        {
-            processHeartbeat();
-        }
+        printf("serverSafeSend err: %ld\n", -res);
+        m_pLogger->err("serverSafeSend err: %ld\n", -res);
+        m_clientData.inFlight = 0;
+        stopClient();
+        return;
     }
-    else if (msgData.type == MSGTYPE_NEW_PROXY)
-    {
-        NewProxyMsg newProxy = {0};
-        memcpy(&newProxy, m_clientData.recvBuf + sizeof(MsgData), msgData.size);
 
-        printf("new proxy %d %d\n", newProxy.userId, newProxy.remotePort);
-        m_pLogger->info("new proxy %d %d", newProxy.userId, newProxy.remotePort);
+    m_clientData.inFlight -= std::min(m_clientData.inFlight, static_cast<size_t>(res));
+    if (m_clientData.inFlight == 0 || !m_clientData.activeConns.empty())
+    {
+        m_clientData.isDirty = true;
+    }
+}
 
-        makeNewProxy(newProxy);
+void Client::markLocalDirty(int fd)
+{
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    if (!conn.isDirty)
+    {
+        conn.isDirty = true;
+        m_dirtyConns.push_back(fd);
     }
-    else if (msgData.type == MSGTYPE_CLIENT_APP_DATA)
+}
+
+// like Server::flushDirtyConns, the one tunnel is flushed after the local conns
+void Client::flushDirtyConns()
+{
+    if (m_reactor.isStopped())
     {
-        int ufd = msgData.userId;
-        int localFd = m_mapUsers[ufd].localFd;
+        return; // the server socket is closed already
+    }
 
-        if (m_mapLocalConn[localFd].isSendBufFull())
+    for (size_t i = 0; i < m_dirtyConns.size(); i++)
+    {
+        int fd = m_dirtyConns[i];
+        auto it = m_mapLocalConn.find(fd);
+        if (it == m_mapLocalConn.end() || !it->second.isDirty)
         {
-            tellServerLocalDown(localFd);
-            deleteLocalConn(localFd);
-            m_pLogger->err("local: %d send buf is full!", localFd);
-            return;
+            continue;
+        }
+        it->second.isDirty = false;
+        if (m_reactor.canSubmitSend())
+        {
+            sendLocalAsync(fd);
+            continue;
         }
-
-        memcpy(
-            m_mapLocalConn[localFd].currSendBufAddr(),
-            m_clientData.recvBuf + sizeof(MsgData),
-            msgData.size
-        );
-        m_mapLocalConn[localFd].sendSize += msgData.size;
-
         m_reactor.registerFileEvent(
-            localFd,
+            fd,
             EVENT_WRITABLE,
             std::bind(
                 &Client::localWriteDataProc,
@@ -357,10 +616,50 @@ void Client::onClientReadDone(size_t dataSize)
                 std::placeholders::_2
             )
         );
+        localWriteDataProc(fd, EVENT_WRITABLE);
     }
-    else if (msgData.type == MSGTYPE_USER_DOWN)
+    m_dirtyConns.clear();
+
+    if (m_clientData.isDirty)
     {
-        deleteLocalConn(m_mapUsers[msgData.userId].localFd);
+        m_clientData.isDirty = false;
+        flushServer();
+    }
+}
+
+void Client::processWindowUpdate(int userId, const WindowUpdateMsg &wum)
+{
+    auto userIt = m_mapUsers.find(userId);
+    if (userIt == m_mapUsers.end())
+    {
+        return; // the conn is closed already
+    }
+    int localFd = userIt->second.localFd;
+    auto connIt = m_mapLocalConn.find(localFd);
+    if (connIt == m_mapLocalConn.end() || connIt->second.userId != userId)
+    {
+        return;
+    }
+
+    LocalConnInfo &conn = connIt->second;
+    if (conn.sendWindow == UNLIMITED_STREAM_WINDOW)
+    {
+        return;
+    }
+    // the server gives back at most what it got, more would wrap the window
+    if (wum.increment > DEFAULT_STREAM_WINDOW - conn.sendWindow)
+    {
+        printf("processWindowUpdate: increment %u over the window of user %d\n", wum.increment, userId);
+        m_pLogger->err("processWindowUpdate: increment %u over the window of user %d", wum.increment, userId);
+        conn.sendWindow = DEFAULT_STREAM_WINDOW;
+    }
+    else
+    {
+        conn.sendWindow += wum.increment;
+    }
+    if (isLocalReadable(localFd))
+    {
+        registerLocalRead(localFd);
     }
 }
 
@@ -403,73 +702,258 @@ void Client::makeNewProxy(const NewProxyMsg &newProxy)
         replyNewProxy(newProxy.userId, false);
         return;
     }
+    // non-blocking like the users on the server, a slow local app must not block the loop
+    tnet::non_block(localFd);
+
+    ChainBuffer bindMsg;
+    int dataFd = -1;
+    if (m_dataMode == DATA_MODE_SPLICE)
+    {
+        dataFd = connectServerData(newProxy.userId, bindMsg);
+        if (dataFd == -1)
+        {
+            close(localFd);
+            replyNewProxy(newProxy.userId, false);
+            return;
+        }
+    }
 
     printf("###uid: %d\n", newProxy.userId);
     m_mapLocalConn[localFd].userId = newProxy.userId;
+    if (m_clientData.frameVersion < FRAME_VERSION_VARINT)
+    {
+        m_mapLocalConn[localFd].sendWindow = UNLIMITED_STREAM_WINDOW;
+    }
+    for (const auto &pi : m_configProxy)
+    {
+        if (pi.remotePort == newProxy.remotePort)
+        {
+            m_mapLocalConn[localFd].weight = pi.weight;
+        }
+    }
+    if (dataFd != -1)
+    {
+        // the reply and the relay wait until the bind is sent, the loop goes on meanwhile
+        LocalConnInfo &conn = m_mapLocalConn[localFd];
+        conn.dataFd = dataFd;
+        conn.bindMsg = std::move(bindMsg);
+        m_mapUsers[newProxy.userId].localFd = localFd;
+        m_reactor.registerFileEvent(dataFd, EVENT_WRITABLE,
+                                    std::bind(&Client::sendDataBindProc,
+                                              this, localFd, std::placeholders::_2));
+        return;
+    }
     replyNewProxy(newProxy.userId, true);
 
     m_mapUsers[newProxy.userId].localFd = localFd;
-    // TODO regist event
-    m_reactor.registerFileEvent(localFd, EVENT_READABLE,
-                                std::bind(&Client::localReadDataProc,
-                                          this, std::placeholders::_1, std::placeholders::_2));
+    if (isLocalReadable(localFd))
+    {
+        registerLocalRead(localFd);
+    }
 }
 
-// send local app data to server ======================================= start
-void Client::localReadDataProc(int fd, int mask)
+int Client::connectServerData(int userId, ChainBuffer &bindMsg)
 {
-    auto recvOffset = m_clientData.sendSize + sizeof(MsgData);
-    if (recvOffset >= MAX_BUF_SIZE)
+    int fd = tnet::tcp_nonblock_connect(m_serverIp, m_serverPort);
+    if (fd == NET_ERR)
     {
-        printf("proxy send buf full\n");
-        m_pLogger->warn("proxy send buf full");
-        return;
+        printf("connect server data err: %d\n", errno);
+        m_pLogger->err("connect server data err: %d", errno);
+        return -1;
     }
 
-    int numRecv = recv(fd, m_clientData.sendBuf + recvOffset,
-                       MAX_BUF_SIZE - recvOffset, MSG_DONTWAIT);
-    if (numRecv == -1)
+    DataBindMsg msg{};
+    memcpy(msg.token, DATA_BIND_TOKEN, sizeof(DATA_BIND_TOKEN));
+    memcpy(msg.sessionToken, m_sessionToken, sizeof(msg.sessionToken));
+    msg.userId = htonl(userId);
+
+    uint8_t buf[MsgUtil::ensureEncryptedDataSize(sizeof(msg))];
+    uint32_t dataLen = MsgUtil::packEncryptedData(m_pBindCryptor, buf, (uint8_t *) &msg, sizeof(msg));
+    bindMsg.append((const char *) buf, dataLen);
+    return fd;
+}
+
+/*
+ * the connect is done when the data connection gets writable, the bind goes first on it.
+ * then the server is told the proxy is made and the relay takes over both sockets,
+ * the local conn is not read before
+ */
+void Client::sendDataBindProc(int fd, int mask)
+{
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    int err = tnet::socket_error(conn.dataFd);
+    while (err == 0 && !conn.bindMsg.empty())
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        size_t len;
+        const char *data = conn.bindMsg.front(&len);
+        ssize_t ret = send(conn.dataFd, data, len, MSG_DONTWAIT);
+        if (ret == -1)
         {
-            printf("localReadDataProc recv err: %d\n", errno);
-            m_pLogger->err("localReadDataProc recv err: %d\n", errno);
-            return;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return; // the rest at next writable
+            }
+            err = errno;
+            break;
         }
+        conn.bindMsg.consume(ret);
     }
-    else if (numRecv == 0)
+
+    int userId = conn.userId;
+    if (err != 0)
     {
-        tellServerLocalDown(fd);
+        printf("connect server data err: %d\n", err);
+        m_pLogger->err("connect server data err: %d", err);
         deleteLocalConn(fd);
+        replyNewProxy(userId, false);
+        return;
     }
-    else if (numRecv > 0)
+
+    m_reactor.removeFileEvent(conn.dataFd, EVENT_WRITABLE);
+    replyNewProxy(userId, true);
+    if (!startLocalRelay(fd, conn.dataFd))
     {
-        MsgData msgData;
-        msgData.type = MSGTYPE_CLIENT_APP_DATA;
-        msgData.size = numRecv;
-        msgData.userId = m_mapLocalConn[fd].userId;
-        memcpy(m_clientData.currSendBufAddr(), &msgData, sizeof(msgData));
+        deleteLocalConn(fd);
+    }
+}
 
-        m_clientData.sendSize += MsgUtil::packEncryptedData(
-                m_pCryptor,
-                (uint8_t *) m_clientData.currSendBufAddr(),
-                (uint8_t *) m_clientData.currSendBufAddr(),
-                numRecv + sizeof(msgData)
-        );
+bool Client::startLocalRelay(int fd, int dataFd)
+{
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    conn.dataFd = dataFd;
+    // the server learns the end of the user from the data connection, no local down is told
+    conn.relay = std::make_unique<SpliceRelay>(m_reactor, fd, dataFd, std::bind(&Client::deleteLocalConn, this, fd));
+    if (!conn.relay->start())
+    {
+        printf("start splice relay err: %d\n", errno);
+        m_pLogger->err("start splice relay err: %d", errno);
+        return false;
+    }
+    return true;
+}
 
-        m_reactor.registerFileEvent(
-            m_clientSocketFd,
-            EVENT_WRITABLE,
-            std::bind(
-                &Client::sendLocalDataProc,
-                this,
-                std::placeholders::_1,
-                std::placeholders::_2
-            )
-        );
-        
-        printf("localReadDataProc: recv from local: %d, client snedSize: %ld\n", numRecv, m_clientData.sendSize);
+void Client::closeLocalData(LocalConnInfo &conn)
+{
+    conn.relay.reset(); // removes the events of both sockets
+    if (conn.dataFd != -1)
+    {
+        m_reactor.removeFileEvent(conn.dataFd, EVENT_READABLE | EVENT_WRITABLE); // still sending the bind
+        close(conn.dataFd);
+        conn.dataFd = -1;
+    }
+}
+
+bool Client::hasLocalConn(int userId)
+{
+    auto it = m_mapUsers.find(userId);
+    return it != m_mapUsers.end() && m_mapLocalConn.count(it->second.localFd) > 0;
+}
+
+bool Client::isLocalReadable(int fd)
+{
+    const LocalConnInfo &conn = m_mapLocalConn[fd];
+    return !conn.isActive && conn.sendWindow > 0;
+}
+
+void Client::registerLocalRead(int fd)
+{
+    m_reactor.registerFileEvent(fd, EVENT_READABLE,
+                                std::bind(&Client::localReadDataProc,
+                                          this, std::placeholders::_1, std::placeholders::_2));
+}
+
+// send local app data to server ======================================= start
+void Client::localReadDataProc(int fd, int mask)
+{
+    // the data waits in the socket until the conn gets its turn
+    m_reactor.removeFileEvent(fd, EVENT_READABLE);
+
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    if (!conn.isActive)
+    {
+        conn.isActive = true;
+        m_clientData.activeConns.push_back(fd);
     }
+
+    // the turns are taken when the tunnel is writable, at the end of this loop if it was not full
+    m_clientData.isDirty = true;
+}
+
+// deficit round robin over the local conns with data waiting, like the users on the server
+size_t Client::scheduleLocalReads(size_t budget)
+{
+    size_t numRead = 0;
+    while (!m_clientData.activeConns.empty() && !m_clientData.isAboveHighWater() && numRead < budget)
+    {
+        int fd = m_clientData.activeConns.front();
+        m_clientData.activeConns.pop_front();
+        LocalConnInfo &conn = m_mapLocalConn[fd];
+        conn.deficit += DRR_QUANTUM * conn.weight;
+
+        bool isDrained = false;
+        bool isClosed = false;
+        while (conn.deficit > 0 && conn.sendWindow > 0)
+        {
+            // recv right into the open record, it is encrypted in place when sealed
+            size_t room;
+            char *payload = m_clientData.batcher.prepare(m_pCryptor, m_clientData.sendQueue, MSGTYPE_CLIENT_APP_DATA,
+                                                         conn.userId, MIN_RECORD_ROOM, &room);
+            size_t recvSize = std::min({room, conn.deficit, static_cast<size_t>(conn.sendWindow)});
+            int numRecv = recv(fd, payload, recvSize, MSG_DONTWAIT);
+            if (numRecv == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    printf("localReadDataProc recv err: %d\n", errno);
+                    m_pLogger->err("localReadDataProc recv err: %d\n", errno);
+                }
+                isDrained = true;
+                break;
+            }
+            else if (numRecv == 0)
+            {
+                isClosed = true;
+                break;
+            }
+
+            if (conn.sendWindow != UNLIMITED_STREAM_WINDOW)
+            {
+                conn.sendWindow -= numRecv;
+            }
+            conn.deficit -= numRecv;
+            numRead += numRecv;
+            m_clientData.batcher.commit(m_pCryptor, m_clientData.sendQueue, numRecv);
+            printf("localReadDataProc: recv from local: %d, client snedSize: %ld\n", numRecv, m_clientData.pendingSize());
+
+            // a short read means the socket is drained
+            if (static_cast<size_t>(numRecv) < recvSize)
+            {
+                isDrained = true;
+                break;
+            }
+        }
+
+        if (isClosed || isDrained || conn.sendWindow == 0)
+        {
+            // out of the round, back when it is readable again or the server gives window
+            conn.isActive = false;
+            conn.deficit = 0;
+            if (isClosed)
+            {
+                tellServerLocalDown(fd);
+                deleteLocalConn(fd);
+            }
+            else if (isLocalReadable(fd))
+            {
+                registerLocalRead(fd);
+            }
+        }
+        else
+        {
+            m_clientData.activeConns.push_back(fd); // more to read, wait for the next round
+        }
+    }
+    return numRead;
 }
 
 void Client::sendLocalDataProc(int fd, int mask)
@@ -499,87 +983,113 @@ void Client::onSendLocalDataDone(int fd)
 
 void Client::localWriteDataProc(int fd, int mask)
 {
-    int numSend = send(fd, m_mapLocalConn[fd].sendBuf, m_mapLocalConn[fd].sendSize, MSG_DONTWAIT);
-    if (numSend > 0)
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    while (!conn.sendBuf.empty())
     {
-        if (numSend == static_cast<int>(m_mapLocalConn[fd].sendSize))
+        struct iovec iov[MAX_WRITE_IOVS];
+        size_t len;
+        int iovCnt = conn.sendBuf.peek(iov, MAX_WRITE_IOVS, &len);
+        int numSend = tnet::send_iov(fd, iov, iovCnt);
+        if (numSend == -1)
         {
-            m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
-            m_mapLocalConn[fd].sendSize = 0;
-            printf("localWriteDataProc: send all data: %d\n", numSend);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("localWriteDataProc send err:%d\n", errno);
+                m_pLogger->err("localWriteDataProc send err:%d", errno);
+            }
+            return;
         }
-        else
+
+        // the buffer has room again, give the credit back to the server
+        conn.sendBuf.consume(numSend);
+        conn.sentToLocal += numSend;
+        if (conn.sentToLocal >= WINDOW_UPDATE_THRESHOLD)
         {
-            size_t newSize = m_mapLocalConn[fd].sendSize - numSend;
-            m_mapLocalConn[fd].sendSize = newSize;
-            memmove(m_mapLocalConn[fd].sendBuf, m_mapLocalConn[fd].sendBuf + numSend, newSize);
-            printf("localWriteDataProc: send partial data: %d, left:%lu\n", numSend, newSize);
-            m_pLogger->warn("localWriteDataProc: send partial data: %d, left:%lu", numSend, newSize);
+            sendServerWindowUpdate(fd);
         }
-    }
-    else
-    {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+
+        if (static_cast<size_t>(numSend) < len)
         {
-            printf("localWriteDataProc send err:%d\n", errno);
-            m_pLogger->err("localWriteDataProc send err:%d", errno);
+            printf("localWriteDataProc: send partial data: %d, left:%lu\n", numSend, conn.sendBuf.size());
+            return;
         }
     }
+
+    m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
+    printf("localWriteDataProc: send all data\n");
 }
 
-void Client::tellServerLocalDown(int lfd)
+// like Server::sendUserAsync
+void Client::sendLocalAsync(int fd)
 {
-    MsgData msgData;
-    msgData.type = MSGTYPE_LOCAL_DOWN;
-    msgData.userId = m_mapLocalConn[lfd].userId;
-    msgData.size = 0;
-
-    m_clientData.sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_clientData.currSendBufAddr(),
-            (uint8_t *) &msgData,
-            sizeof(msgData)
-    );
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    if (conn.inFlight > 0 || conn.sendBuf.empty())
+    {
+        return;
+    }
 
-    m_reactor.registerFileEvent(
-        m_clientSocketFd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Client::tellServerLocalDownProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
+    ChainBuffer buf;
+    buf.append(std::move(conn.sendBuf));
+    conn.inFlight = buf.size();
+    m_reactor.submitSend(fd, std::move(buf),
+                         std::bind(&Client::onLocalSendDone,
+                                   this, std::placeholders::_1, std::placeholders::_2));
 }
 
-void Client::tellServerLocalDownProc(int fd, int mask)
+void Client::onLocalSendDone(int fd, ssize_t res)
 {
-    if (!(mask & EVENT_WRITABLE))
+    LocalConnInfo &conn = m_mapLocalConn[fd];
+    if (res < 0)
     {
+        printf("localWriteDataProc send err:%ld\n", -res);
+        m_pLogger->err("localWriteDataProc send err:%ld", -res);
+        conn.inFlight = 0;
+        tellServerLocalDown(fd);
+        deleteLocalConn(fd);
         return;
     }
 
-    serverSafeSend(
-        fd, 
-        std::bind(
-            &Client::onTellServerLocalDownDone,
-            this,
-            std::placeholders::_1
-        )
-    );
+    conn.inFlight -= std::min(conn.inFlight, static_cast<size_t>(res));
+    conn.sentToLocal += res;
+    if (conn.sentToLocal >= WINDOW_UPDATE_THRESHOLD)
+    {
+        sendServerWindowUpdate(fd);
+    }
+    sendLocalAsync(fd);
 }
 
-void Client::onTellServerLocalDownDone(int fd)
+void Client::sendServerWindowUpdate(int lfd)
 {
-    m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
-    printf("onTellServerLocalDownDone\n");
+    WindowUpdateMsg wum = {0};
+    wum.increment = m_mapLocalConn[lfd].sentToLocal;
+    m_mapLocalConn[lfd].sentToLocal = 0;
+    if (m_clientData.frameVersion < FRAME_VERSION_VARINT)
+    {
+        return; // an old server has no windows
+    }
+
+    char buf[sizeof(wum)];
+    size_t bufSize = FrameCodec::encodeWindowUpdate(m_clientData.frameVersion, wum, buf);
+    addServerFrame(MSGTYPE_WINDOW_UPDATE, m_mapLocalConn[lfd].userId, buf, bufSize);
+}
+
+void Client::tellServerLocalDown(int lfd)
+{
+    addServerFrame(MSGTYPE_LOCAL_DOWN, m_mapLocalConn[lfd].userId, nullptr, 0);
 }
 
 void Client::deleteLocalConn(int fd)
 {
+    if (m_mapLocalConn[fd].isActive)
+    {
+        // out of the round
+        std::deque<int> &activeConns = m_clientData.activeConns;
+        activeConns.erase(std::remove(activeConns.begin(), activeConns.end(), fd), activeConns.end());
+    }
     m_mapUsers.erase(m_mapLocalConn[fd].userId);
+    closeLocalData(m_mapLocalConn[fd]);
     m_mapLocalConn.erase(fd);
+    m_reactor.cancelSend(fd);
     close(fd);
     m_reactor.removeFileEvent(fd, EVENT_WRITABLE | EVENT_READABLE);
 
@@ -589,61 +1099,14 @@ void Client::deleteLocalConn(int fd)
 
 void Client::replyNewProxy(int userId, bool isSuccess)
 {
-    MsgData msgData;
     ReplyNewProxyMsg replyMsg = {false};
-
     replyMsg.isSuccess = isSuccess;
-    msgData.type = MSGTYPE_REPLY_NEW_PROXY;
-    msgData.size = sizeof(replyMsg);
 
     printf("~~~~~~~ userId: %d\n", userId);
 
-    size_t bufSize = sizeof(msgData) + sizeof(replyMsg);
-    char buf[bufSize];
-
-    memcpy(buf, &msgData, sizeof(msgData));
-    memcpy(buf + sizeof(msgData), &replyMsg, sizeof(replyMsg));
-
-    m_clientData.sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_clientData.currSendBufAddr(),
-            (uint8_t *) buf,
-            bufSize
-    );
-
-    m_reactor.registerFileEvent(
-        m_clientSocketFd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Client::replyNewProxyProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
-}
-
-void Client::replyNewProxyProc(int fd, int mask)
-{
-    if (!(mask & EVENT_WRITABLE))
-    {
-        return;
-    }
-
-    serverSafeSend(
-        fd, 
-        std::bind(
-            &Client::onReplyNewProxyDone,
-            this,
-            std::placeholders::_1
-        )
-    );
-}
-
-void Client::onReplyNewProxyDone(int fd)
-{
-    m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
-    printf("onReplyNewProxyDone\n");
+    char buf[sizeof(replyMsg)];
+    size_t bufSize = FrameCodec::encodeReplyNewProxy(m_clientData.frameVersion, replyMsg, buf);
+    addServerFrame(MSGTYPE_REPLY_NEW_PROXY, userId, buf, bufSize);
 }
 
 int Client::connectLocalApp(unsigned short remotePort)
@@ -677,59 +1140,11 @@ int Client::connectLocalApp(unsigned short remotePort)
 
 int Client::sendHeartbeatTimerProc(long long id)
 {
-    MsgData heartData;
-    heartData.type = MSGTYPE_HEARTBEAT;
-    heartData.size = strlen(HEARTBEAT_CLIENT_MSG);
-
-    size_t dataSize = sizeof(heartData) + strlen(HEARTBEAT_CLIENT_MSG);
-    char bufData[dataSize];
-
-    memcpy(bufData, &heartData, sizeof(heartData));
-    memcpy(bufData + sizeof(heartData), HEARTBEAT_CLIENT_MSG, strlen(HEARTBEAT_CLIENT_MSG));
+    addServerFrame(MSGTYPE_HEARTBEAT, 0, HEARTBEAT_CLIENT_MSG, strlen(HEARTBEAT_CLIENT_MSG));
 
-    m_clientData.sendSize += MsgUtil::packEncryptedData(
-        m_pCryptor,
-        (uint8_t *) m_clientData.currSendBufAddr(),
-        (uint8_t *) bufData,
-        dataSize
-    );
-
-    m_reactor.registerFileEvent(
-        m_clientSocketFd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Client::writeHeartbeatDataProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
-    
     return HEARTBEAT_INTERVAL_MS;
 }
 
-void Client::writeHeartbeatDataProc(int fd, int mask)
-{
-    if (!(mask & EVENT_WRITABLE))
-    {
-        return;
-    }
-
-    serverSafeSend(
-        fd, 
-        std::bind(
-            &Client::onWriteHeartbeatDataDone,
-            this,
-            std::placeholders::_1
-        )
-    );
-}
-
-void Client::onWriteHeartbeatDataDone(int fd)
-{
-    m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
-}
-
 
 void Client::setProxyConfig(const std::vector<ProxyInfo> &pcs)
 {
@@ -746,6 +1161,18 @@ void Client::setPassword(const char *password)
     strncpy(m_password, MD5(password).toStr().c_str(), PW_MAX_LEN);
 
     m_pCryptor = std::make_unique<Cryptor>(CRYPT_CBC, (uint8_t*)m_password);
+    m_pBindCryptor = std::make_unique<Cryptor>(CRYPT_CBC, (uint8_t*)m_password);
+}
+
+void Client::setPassthrough(bool isPassthrough)
+{
+    if (isPassthrough && !SpliceRelay::isSupported())
+    {
+        printf("cipher = none needs splice, user data stays in the tunnel\n");
+        m_pLogger->err("cipher = none needs splice, user data stays in the tunnel");
+        isPassthrough = false;
+    }
+    m_isPassthrough = isPassthrough;
 }
 
 void Client::runClient()
@@ -807,13 +1234,16 @@ void Client::stopClient()
     m_reactor.stopEventLoop();
     if (m_clientSocketFd != -1)
     {
+        m_reactor.cancelSend(m_clientSocketFd);
         close(m_clientSocketFd);
         m_reactor.removeFileEvent(m_clientSocketFd, EVENT_READABLE | EVENT_WRITABLE);
     }
 
-    for (const auto &it : m_mapLocalConn)
+    for (auto &it : m_mapLocalConn)
     {
+        closeLocalData(it.second);
         m_reactor.removeFileEvent(it.first, EVENT_READABLE | EVENT_WRITABLE);
+        m_reactor.cancelSend(it.first);
         close(it.first);
     }
 }
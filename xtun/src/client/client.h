@@ -2,18 +2,21 @@
 #define __CLIENT_H__
 
 #include <netinet/in.h>
+#include <deque>
 #include <vector>
 #include <unordered_map>
 #include <memory>
 
 #include "../msg/msgdata.h"
 #include "../msg/cryptor.h"
+#include "../msg/batcher.h"
+#include "../msg/codec.h"
 
 #include "../net/reactor.h"
+#include "../net/splice_relay.h"
 #include "../third_part/logger.h"
 
 
-const size_t REAL_MAX_BUF_SIZE = MAX_BUF_SIZE + AES_BLOCKLEN + sizeof(DataHeader);
 
 const int HEARTBEAT_INTERVAL_MS = 1000; // 每次心跳的间隔时间
 const long DEFAULT_SERVER_TIMEOUT_MS = 5000; // 默认5秒没收到服务端的心跳表示服务端不在线
@@ -24,6 +27,7 @@ struct ProxyInfo
   unsigned short remotePort;
   unsigned short localPort;
   char localIp[INET_ADDRSTRLEN];
+  unsigned short weight;     // share of the tunnel among the proxies, 1 ~ MAX_PROXY_WEIGHT
 };
 
 
@@ -43,19 +47,26 @@ struct NetData
 
   DataHeader header;
 
-  char recvBuf[REAL_MAX_BUF_SIZE];
+  ChunkPtr recvBuf; // one record at most, taken from the pool while receiving
 
-  size_t sendSize;
-  char sendBuf[REAL_MAX_BUF_SIZE];
+  RecordQueue sendQueue; // control records go ahead of the data records not started yet
+  FrameBatcher ctrlBatcher{LANE_CONTROL}; // heartbeats, new proxy replies and window updates
+  FrameBatcher batcher; // frames of this loop, sealed as one record before sending
+  uint8_t frameVersion{FRAME_VERSION_FIXED}; // encoding of the messages, agreed at auth
 
-  bool isSendBufFull()
+  std::deque<int> activeConns; // local conns with data waiting for their turn, see scheduleLocalReads
+  bool isSocketFull{false};    // the last flush didn't send it all, wait for the writable event
+  bool isDirty{false};         // frames were added in this loop, flushed at its end
+  size_t inFlight{0};          // io_uring: handed to the kernel and not sent yet, see sendServerAsync
+
+  size_t pendingSize() const
   {
-    return sendSize >= MAX_BUF_SIZE;
+    return sendQueue.size() + ctrlBatcher.size() + batcher.size() + inFlight;
   }
 
-  char* currSendBufAddr()
+  bool isAboveHighWater()
   {
-    return sendBuf + sendSize;
+    return pendingSize() >= TUNNEL_HIGH_WATER_MARK;
   }
 };
 
@@ -64,17 +75,24 @@ struct LocalConnInfo
 {
   int userId;
 
-  size_t sendSize{0};
-  char sendBuf[REAL_MAX_BUF_SIZE];
+  ChainBuffer sendBuf;
+  size_t inFlight{0}; // io_uring: handed to the kernel and not written yet, see sendLocalAsync
 
-  bool isSendBufFull()
-  {
-    return sendSize >= MAX_BUF_SIZE;
-  }
+  uint32_t sendWindow{DEFAULT_STREAM_WINDOW}; // bytes the server can still take from this conn
+  uint32_t sentToLocal{0};                    // bytes written to local app, not told to the server yet
 
-  char* currSendBufAddr()
+  unsigned short weight{1};
+  size_t deficit{0};    // bytes it may still read in this round
+  bool isActive{false}; // in activeConns
+  bool isDirty{false};  // sendBuf got data in this loop while empty, in m_dirtyConns
+
+  int dataFd{-1};                     // DATA_MODE_SPLICE: the connection to the server for this user
+  ChainBuffer bindMsg;                // sent once dataFd is connected, the relay starts after it
+  std::unique_ptr<SpliceRelay> relay; // moves the bytes between the conn and dataFd, not through the tunnel
+
+  bool isSendBufFull()
   {
-    return sendBuf + sendSize;
+    return sendBuf.size() + inFlight >= MAX_BUF_SIZE;
   }
 };
 using LocalConnInfoMap = std::unordered_map<int, LocalConnInfo>;
@@ -104,39 +122,69 @@ private:
   NetData m_clientData;
 
   LocalConnInfoMap m_mapLocalConn;
+  std::vector<int> m_dirtyConns; // local conns to write at the end of this loop, see flushDirtyConns
   UserInfoMap m_mapUsers;
 
   std::shared_ptr<Logger> m_pLogger;
   std::unique_ptr<Cryptor> m_pCryptor;
+  std::unique_ptr<Cryptor> m_pBindCryptor; // cbc like the auth records, for the binds of the data connections
+
+  // cipher = none: each user gets a plain connection to the server, bound by the token of the session
+  bool m_isPassthrough{false};
+  DATA_MODE m_dataMode{DATA_MODE_TUNNEL}; // what the server agreed to
+  uint8_t m_sessionToken[SESSION_TOKEN_LEN]{};
 
-  void serverSafeRecv(int fd, const std::function<void(size_t dataSize)>& callback);  // recv crypted msg from server
+  // recv crypted msg from server, returns bytes received, 0 if the server is gone, -1 if nothing to read
+  int serverSafeRecv(int fd, const std::function<void(size_t dataSize)>& callback);
   void serverSafeSend(int fd, const std::function<void(int fd)>& callback);
   
   void clientReadProc(int fd, int mask);
   void onClientReadDone(size_t dataSize);
+  void addServerFrame(int type, uint32_t streamId, const void *data, size_t size); // into the open record
+  void flushServer(); // send the pending frames now, the writable event only for the rest
+  void sendServerAsync(); // flushServer with io_uring, the kernel sends it all by itself
+  void onServerSendDone(int fd, ssize_t res);
+  void markLocalDirty(int fd); // write it at the end of this loop
+  void flushDirtyConns(); // before sleep proc of the reactor
+
+  // one message of a record, dispatched by type
+  using ServerFrameHandler = void (Client::*)(const Frame &frame);
+  static const ServerFrameHandler s_serverFrameHandlers[MSGTYPE_COUNT];
+  void onHeartbeatFrame(const Frame &frame);
+  void onNewProxyFrame(const Frame &frame);
+  void onAppDataFrame(const Frame &frame);
+  void onUserDownFrame(const Frame &frame);
+  void onWindowUpdateFrame(const Frame &frame);
 
   int sendPorts();
   void makeNewProxy(const NewProxyMsg &newProxy);
   int connectLocalApp(unsigned short remotePort);
+  // start a data connection for the user and put its bind in bindMsg, -1 if it fails at once
+  int connectServerData(int userId, ChainBuffer &bindMsg);
+  void sendDataBindProc(int fd, int mask); // the data connection of local conn fd is writable
+  bool startLocalRelay(int fd, int dataFd);
+  void closeLocalData(LocalConnInfo &conn);
 
   void replyNewProxy(int userId, bool isSuccess);
-  void replyNewProxyProc(int fd, int mask);
-  void onReplyNewProxyDone(int fd);
 
   int sendHeartbeatTimerProc(long long id);
-  void writeHeartbeatDataProc(int fd, int mask);
-  void onWriteHeartbeatDataDone(int fd);
 
   void processHeartbeat();
   int checkHeartbeatTimerProc(long long id);
 
-  void localReadDataProc(int fd, int mask);
+  bool hasLocalConn(int userId); // the user still has its local conn
+  bool isLocalReadable(int fd); // not waiting for its turn and the stream has window
+  void registerLocalRead(int fd);
+  void localReadDataProc(int fd, int mask); // the conn has data, wait for its turn
+  size_t scheduleLocalReads(size_t budget); // read the conns in turn by weight
   void sendLocalDataProc(int fd, int mask);
   void onSendLocalDataDone(int fd);
   void localWriteDataProc(int fd, int mask);
+  void sendLocalAsync(int fd); // io_uring: the whole sendBuf is handed to the kernel
+  void onLocalSendDone(int fd, ssize_t res);
+  void sendServerWindowUpdate(int fd);
+  void processWindowUpdate(int userId, const WindowUpdateMsg &wum);
   void tellServerLocalDown(int fd);
-  void tellServerLocalDownProc(int fd, int mask);
-  void onTellServerLocalDownDone(int fd);
 
   void deleteLocalConn(int fd);
 
@@ -152,6 +200,7 @@ public:
 
   void setProxyConfig(const std::vector<ProxyInfo> &pcs);
   void setPassword(const char *password);
+  void setPassthrough(bool isPassthrough); // cipher = none, the server must have it too
 
   void runClient();
   void stopClient();
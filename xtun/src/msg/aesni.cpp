@@ -0,0 +1,471 @@
+#include "aesni.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#define GCM_TARGET __attribute__((target("aes,pclmul,ssse3,sse2")))
+#define AESNI_PARALLEL 8 // blocks in flight, hides the latency of aesenc/aesdec
+
+bool hasAesni()
+{
+    static const bool available = []() {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            return false;
+        }
+        return (ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0;
+    }();
+    return available;
+}
+
+bool hasAesniGcm()
+{
+    static const bool available = []() {
+        unsigned int eax, ebx, ecx, edx;
+        if (!hasAesni() || !__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            return false;
+        }
+        return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSSE3) != 0;
+    }();
+    return available;
+}
+
+AESNI_TARGET static inline __m128i expandAssist1(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+AESNI_TARGET static inline __m128i expandAssist2(__m128i prev, __m128i key)
+{
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define EXPAND_ROUND(i, rcon)                                                                  \
+    k0 = expandAssist1(k0, _mm_aeskeygenassist_si128(k1, rcon));                               \
+    rk[i] = k0;                                                                                \
+    if (i + 1 <= AESNI_ROUNDS)                                                                 \
+    {                                                                                          \
+        k1 = expandAssist2(k0, k1);                                                            \
+        rk[i + 1] = k1;                                                                        \
+    }
+
+AESNI_TARGET void aesniExpandKey(const uint8_t *key, AesniKey *ks)
+{
+    __m128i rk[AESNI_ROUNDS + 2];
+    __m128i k0 = _mm_loadu_si128((const __m128i *) key);
+    __m128i k1 = _mm_loadu_si128((const __m128i *) (key + 16));
+    rk[0] = k0;
+    rk[1] = k1;
+    EXPAND_ROUND(2, 0x01)
+    EXPAND_ROUND(4, 0x02)
+    EXPAND_ROUND(6, 0x04)
+    EXPAND_ROUND(8, 0x08)
+    EXPAND_ROUND(10, 0x10)
+    EXPAND_ROUND(12, 0x20)
+    EXPAND_ROUND(14, 0x40)
+
+    // the equivalent inverse cipher runs the encryption keys backwards through aesimc
+    for (int i = 0; i <= AESNI_ROUNDS; i++)
+    {
+        _mm_store_si128((__m128i *) ks->enc[i], rk[i]);
+        __m128i d = rk[AESNI_ROUNDS - i];
+        if (i != 0 && i != AESNI_ROUNDS)
+        {
+            d = _mm_aesimc_si128(d);
+        }
+        _mm_store_si128((__m128i *) ks->dec[i], d);
+    }
+}
+
+AESNI_TARGET static inline void loadKeys(const uint8_t (*src)[AES_BLOCKLEN], __m128i *rk)
+{
+    for (int i = 0; i <= AESNI_ROUNDS; i++)
+    {
+        rk[i] = _mm_load_si128((const __m128i *) src[i]);
+    }
+}
+
+AESNI_TARGET static inline __m128i encryptBlock(const __m128i *rk, __m128i b)
+{
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < AESNI_ROUNDS; r++)
+    {
+        b = _mm_aesenc_si128(b, rk[r]);
+    }
+    return _mm_aesenclast_si128(b, rk[AESNI_ROUNDS]);
+}
+
+AESNI_TARGET static inline __m128i decryptBlock(const __m128i *rk, __m128i b)
+{
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < AESNI_ROUNDS; r++)
+    {
+        b = _mm_aesdec_si128(b, rk[r]);
+    }
+    return _mm_aesdeclast_si128(b, rk[AESNI_ROUNDS]);
+}
+
+// cbc encryption chains every block on the previous one, it can't be pipelined
+AESNI_TARGET void aesniCbcEncrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->enc, rk);
+
+    __m128i prev = _mm_loadu_si128((const __m128i *) iv);
+    for (uint32_t i = 0; i + AES_BLOCKLEN <= length; i += AES_BLOCKLEN)
+    {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (buf + i)), prev);
+        prev = encryptBlock(rk, b);
+        _mm_storeu_si128((__m128i *) (buf + i), prev);
+    }
+}
+
+AESNI_TARGET void aesniCbcDecrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->dec, rk);
+
+    __m128i prev = _mm_loadu_si128((const __m128i *) iv);
+    uint32_t i = 0;
+    for (; i + AESNI_PARALLEL * AES_BLOCKLEN <= length; i += AESNI_PARALLEL * AES_BLOCKLEN)
+    {
+        __m128i c[AESNI_PARALLEL], b[AESNI_PARALLEL];
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            c[j] = _mm_loadu_si128((const __m128i *) (buf + i + j * AES_BLOCKLEN));
+            b[j] = _mm_xor_si128(c[j], rk[0]);
+        }
+        for (int r = 1; r < AESNI_ROUNDS; r++)
+        {
+            for (int j = 0; j < AESNI_PARALLEL; j++)
+            {
+                b[j] = _mm_aesdec_si128(b[j], rk[r]);
+            }
+        }
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            b[j] = _mm_aesdeclast_si128(b[j], rk[AESNI_ROUNDS]);
+            b[j] = _mm_xor_si128(b[j], j == 0 ? prev : c[j - 1]);
+            _mm_storeu_si128((__m128i *) (buf + i + j * AES_BLOCKLEN), b[j]);
+        }
+        prev = c[AESNI_PARALLEL - 1];
+    }
+    for (; i + AES_BLOCKLEN <= length; i += AES_BLOCKLEN)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *) (buf + i));
+        _mm_storeu_si128((__m128i *) (buf + i), _mm_xor_si128(decryptBlock(rk, c), prev));
+        prev = c;
+    }
+}
+
+// the 128 bits big endian counter is kept as two native halves
+struct CtrCounter
+{
+    uint64_t hi;
+    uint64_t lo;
+};
+
+AESNI_TARGET static inline __m128i nextCounterBlock(CtrCounter *ctr)
+{
+    __m128i block = _mm_set_epi64x((long long) __builtin_bswap64(ctr->lo), (long long) __builtin_bswap64(ctr->hi));
+    if (++ctr->lo == 0)
+    {
+        ++ctr->hi;
+    }
+    return block;
+}
+
+AESNI_TARGET void aesniCtrXcrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->enc, rk);
+
+    CtrCounter ctr;
+    memcpy(&ctr.hi, iv, sizeof(ctr.hi));
+    memcpy(&ctr.lo, iv + sizeof(ctr.hi), sizeof(ctr.lo));
+    ctr.hi = __builtin_bswap64(ctr.hi);
+    ctr.lo = __builtin_bswap64(ctr.lo);
+
+    uint32_t i = 0;
+    for (; i + AESNI_PARALLEL * AES_BLOCKLEN <= length; i += AESNI_PARALLEL * AES_BLOCKLEN)
+    {
+        __m128i b[AESNI_PARALLEL];
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            b[j] = _mm_xor_si128(nextCounterBlock(&ctr), rk[0]);
+        }
+        for (int r = 1; r < AESNI_ROUNDS; r++)
+        {
+            for (int j = 0; j < AESNI_PARALLEL; j++)
+            {
+                b[j] = _mm_aesenc_si128(b[j], rk[r]);
+            }
+        }
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            __m128i *p = (__m128i *) (buf + i + j * AES_BLOCKLEN);
+            b[j] = _mm_aesenclast_si128(b[j], rk[AESNI_ROUNDS]);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b[j]));
+        }
+    }
+    for (; i < length; i += AES_BLOCKLEN)
+    {
+        uint8_t stream[AES_BLOCKLEN];
+        _mm_storeu_si128((__m128i *) stream, encryptBlock(rk, nextCounterBlock(&ctr)));
+
+        uint32_t n = length - i < AES_BLOCKLEN ? length - i : AES_BLOCKLEN;
+        for (uint32_t k = 0; k < n; k++)
+        {
+            buf[i + k] ^= stream[k];
+        }
+    }
+}
+
+/*
+ * gcm. ghash works on byte reflected blocks, the multiplication is the one of the
+ * intel carry-less multiplication white paper, its reduction is linear so the
+ * products of 4 blocks are summed first and reduced once.
+ */
+GCM_TARGET static inline __m128i bswapBlock(__m128i b)
+{
+    return _mm_shuffle_epi8(b, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// unreduced 256 bits product, accumulated into lo/hi
+GCM_TARGET static inline void clmulAcc(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+    __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(low, _mm_slli_si128(mid, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(high, _mm_srli_si128(mid, 8)));
+}
+
+GCM_TARGET static inline __m128i ghashReduce(__m128i lo, __m128i hi)
+{
+    // shift the product left by one bit, the operands are bit reflected
+    __m128i carryLo = _mm_srli_epi32(lo, 31);
+    __m128i carryHi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross = _mm_srli_si128(carryLo, 12);
+    carryHi = _mm_slli_si128(carryHi, 4);
+    carryLo = _mm_slli_si128(carryLo, 4);
+    lo = _mm_or_si128(lo, carryLo);
+    hi = _mm_or_si128(_mm_or_si128(hi, carryHi), cross);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i t2 = _mm_srli_si128(t, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+    __m128i r = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    r = _mm_xor_si128(r, t2);
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, r));
+}
+
+GCM_TARGET static inline __m128i gfmul(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    clmulAcc(a, b, &lo, &hi);
+    return ghashReduce(lo, hi);
+}
+
+GCM_TARGET void aesniGcmInit(AesniKey *ks)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->enc, rk);
+
+    __m128i h = bswapBlock(encryptBlock(rk, _mm_setzero_si128()));
+    __m128i power = h;
+    for (int i = 0; i < GHASH_POWERS; i++)
+    {
+        _mm_store_si128((__m128i *) ks->ghash[i], power);
+        power = gfmul(power, h);
+    }
+}
+
+GCM_TARGET static __m128i ghashUpdate(const AesniKey *ks, __m128i x, const uint8_t *data, uint32_t length)
+{
+    __m128i h[GHASH_POWERS];
+    for (int i = 0; i < GHASH_POWERS; i++)
+    {
+        h[i] = _mm_load_si128((const __m128i *) ks->ghash[i]);
+    }
+
+    uint32_t i = 0;
+    for (; i + GHASH_POWERS * AES_BLOCKLEN <= length; i += GHASH_POWERS * AES_BLOCKLEN)
+    {
+        // x = (x ^ c1) * H^4 ^ c2 * H^3 ^ c3 * H^2 ^ c4 * H
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for (int j = 0; j < GHASH_POWERS; j++)
+        {
+            __m128i c = bswapBlock(_mm_loadu_si128((const __m128i *) (data + i + j * AES_BLOCKLEN)));
+            if (j == 0)
+            {
+                c = _mm_xor_si128(c, x);
+            }
+            clmulAcc(c, h[GHASH_POWERS - 1 - j], &lo, &hi);
+        }
+        x = ghashReduce(lo, hi);
+    }
+    for (; i < length; i += AES_BLOCKLEN)
+    {
+        uint8_t block[AES_BLOCKLEN] = {0};
+        uint32_t n = length - i < AES_BLOCKLEN ? length - i : AES_BLOCKLEN;
+        memcpy(block, data + i, n);
+        x = gfmul(_mm_xor_si128(x, bswapBlock(_mm_loadu_si128((const __m128i *) block))), h[0]);
+    }
+    return x;
+}
+
+GCM_TARGET static void gcmTag(const AesniKey *ks, const __m128i *rk, __m128i j0, const uint8_t *cipher, uint32_t length, uint8_t *tag)
+{
+    __m128i x = ghashUpdate(ks, _mm_setzero_si128(), cipher, length);
+    // no aad, the lengths block is 0 || bit length of the cipher text
+    __m128i lengths = _mm_set_epi64x(0, (long long) length * 8);
+    x = gfmul(_mm_xor_si128(x, lengths), _mm_load_si128((const __m128i *) ks->ghash[0]));
+    _mm_storeu_si128((__m128i *) tag, _mm_xor_si128(bswapBlock(x), encryptBlock(rk, j0)));
+}
+
+// counter blocks are nonce || 32 bits big endian counter, counted on the byte reflected form
+GCM_TARGET static void gcmCtr(const __m128i *rk, __m128i j0, uint8_t *buf, uint32_t length)
+{
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    __m128i ctr = _mm_add_epi32(bswapBlock(j0), one);
+
+    uint32_t i = 0;
+    for (; i + AESNI_PARALLEL * AES_BLOCKLEN <= length; i += AESNI_PARALLEL * AES_BLOCKLEN)
+    {
+        __m128i b[AESNI_PARALLEL];
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            b[j] = _mm_xor_si128(bswapBlock(ctr), rk[0]);
+            ctr = _mm_add_epi32(ctr, one);
+        }
+        for (int r = 1; r < AESNI_ROUNDS; r++)
+        {
+            for (int j = 0; j < AESNI_PARALLEL; j++)
+            {
+                b[j] = _mm_aesenc_si128(b[j], rk[r]);
+            }
+        }
+        for (int j = 0; j < AESNI_PARALLEL; j++)
+        {
+            __m128i *p = (__m128i *) (buf + i + j * AES_BLOCKLEN);
+            b[j] = _mm_aesenclast_si128(b[j], rk[AESNI_ROUNDS]);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b[j]));
+        }
+    }
+    for (; i < length; i += AES_BLOCKLEN)
+    {
+        uint8_t stream[AES_BLOCKLEN];
+        _mm_storeu_si128((__m128i *) stream, encryptBlock(rk, bswapBlock(ctr)));
+        ctr = _mm_add_epi32(ctr, one);
+
+        uint32_t n = length - i < AES_BLOCKLEN ? length - i : AES_BLOCKLEN;
+        for (uint32_t k = 0; k < n; k++)
+        {
+            buf[i + k] ^= stream[k];
+        }
+    }
+}
+
+GCM_TARGET static inline __m128i gcmJ0(const uint8_t *nonce)
+{
+    uint8_t j0[AES_BLOCKLEN] = {0};
+    memcpy(j0, nonce, GCM_NONCE_LEN);
+    j0[AES_BLOCKLEN - 1] = 1;
+    return _mm_loadu_si128((const __m128i *) j0);
+}
+
+GCM_TARGET void aesniGcmEncrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, uint8_t *tag)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->enc, rk);
+
+    __m128i j0 = gcmJ0(nonce);
+    gcmCtr(rk, j0, buf, length);
+    gcmTag(ks, rk, j0, buf, length, tag);
+}
+
+// the tag is checked before anything is decrypted, a forged record is left as it is
+GCM_TARGET bool aesniGcmDecrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, const uint8_t *tag)
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+    loadKeys(ks->enc, rk);
+
+    __m128i j0 = gcmJ0(nonce);
+    uint8_t expected[GCM_TAG_LEN];
+    gcmTag(ks, rk, j0, buf, length, expected);
+
+    uint8_t diff = 0; // constant time compare
+    for (int i = 0; i < GCM_TAG_LEN; i++)
+    {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0)
+    {
+        return false;
+    }
+
+    gcmCtr(rk, j0, buf, length);
+    return true;
+}
+
+#else // no AES-NI on this architecture, Cryptor stays on tiny-AES
+
+bool hasAesni()
+{
+    return false;
+}
+
+bool hasAesniGcm()
+{
+    return false;
+}
+
+void aesniExpandKey(const uint8_t *key, AesniKey *ks)
+{
+}
+
+void aesniCbcEncrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+}
+
+void aesniCbcDecrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+}
+
+void aesniCtrXcrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length)
+{
+}
+
+void aesniGcmInit(AesniKey *ks)
+{
+}
+
+void aesniGcmEncrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, uint8_t *tag)
+{
+}
+
+bool aesniGcmDecrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, const uint8_t *tag)
+{
+    return false;
+}
+
+#endif
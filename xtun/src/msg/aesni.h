@@ -0,0 +1,41 @@
+#ifndef __AESNI_H__
+#define __AESNI_H__
+
+#include <stdint.h>
+
+#include "../third_part/aes.hpp"
+
+#define AESNI_ROUNDS 14 // AES-256
+#define GCM_NONCE_LEN 12
+#define GCM_TAG_LEN 16
+#define GHASH_POWERS 4  // blocks hashed per reduction
+
+/*
+ * AES-256 on the AES-NI instructions, same results as tiny-AES.
+ * only call the other functions when hasAesni() is true.
+ */
+struct AesniKey
+{
+    alignas(16) uint8_t enc[AESNI_ROUNDS + 1][AES_BLOCKLEN];
+    alignas(16) uint8_t dec[AESNI_ROUNDS + 1][AES_BLOCKLEN];
+    alignas(16) uint8_t ghash[GHASH_POWERS][AES_BLOCKLEN]; // H^1..H^4 for gcm, set by aesniGcmInit
+};
+
+bool hasAesni(); // checked once with cpuid
+bool hasAesniGcm(); // AES-NI plus PCLMULQDQ for ghash
+
+void aesniExpandKey(const uint8_t *key, AesniKey *ks);
+
+// length must be a multiple of AES_BLOCKLEN
+void aesniCbcEncrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length);
+void aesniCbcDecrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length);
+
+// the iv is a 128 bits big endian counter, any length
+void aesniCtrXcrypt(const AesniKey *ks, const uint8_t *iv, uint8_t *buf, uint32_t length);
+
+// gcm with a 96 bits nonce and no aad, the 16 bytes tag is put in / checked against tag
+void aesniGcmInit(AesniKey *ks);
+void aesniGcmEncrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, uint8_t *tag);
+bool aesniGcmDecrypt(const AesniKey *ks, const uint8_t *nonce, uint8_t *buf, uint32_t length, const uint8_t *tag);
+
+#endif // __AESNI_H__
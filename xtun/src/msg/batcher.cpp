@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "batcher.h"
+
+
+size_t FrameBatcher::s_maxFramesSize = MAX_RECORD_FRAMES_SIZE;
+
+void FrameBatcher::setMaxRecordSize(size_t recordSize)
+{
+    recordSize = std::min(std::max(recordSize, MIN_RECORD_SIZE), BUFFER_CHUNK_SIZE);
+    s_maxFramesSize = recordSize - sizeof(DataHeader) - AES_BLOCKLEN;
+}
+
+size_t FrameBatcher::maxRecordSize()
+{
+    return s_maxFramesSize + sizeof(DataHeader) + AES_BLOCKLEN;
+}
+
+char *FrameBatcher::prepare(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+                            size_t minSize, size_t *room)
+{
+    // the size is not known yet, the header is made as long as the biggest frame needs
+    size_t headerSize = FrameCodec::headerSize(m_frameVersion, type, streamId, s_maxFramesSize);
+    return reserve(cryptor, queue, type, streamId, headerSize, minSize, room);
+}
+
+char *FrameBatcher::reserve(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+                            size_t headerSize, size_t minSize, size_t *room)
+{
+    m_frameType = type;
+    m_frameStreamId = streamId;
+    m_frameHeaderSize = headerSize;
+
+    minSize = std::min(minSize, s_maxFramesSize - MAX_FRAME_HEADER_SIZE); // a small record takes less at a time
+    if (s_maxFramesSize - m_size < m_frameHeaderSize + minSize)
+    {
+        seal(cryptor, queue);
+    }
+    if (!m_record)
+    {
+        m_record = acquireChunk();
+    }
+
+    if (room != nullptr)
+    {
+        *room = s_maxFramesSize - m_size - m_frameHeaderSize;
+    }
+    return m_record->data + sizeof(DataHeader) + m_size + m_frameHeaderSize;
+}
+
+void FrameBatcher::commit(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, size_t n)
+{
+    FrameCodec::encodeHeader(m_frameVersion, m_record->data + sizeof(DataHeader) + m_size, m_frameHeaderSize,
+                             m_frameType, m_frameStreamId, n);
+    m_size += m_frameHeaderSize + n;
+
+    if (!m_isBatching)
+    {
+        seal(cryptor, queue);
+    }
+}
+
+void FrameBatcher::add(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+                       const void *data, size_t n)
+{
+    size_t headerSize = FrameCodec::headerSize(m_frameVersion, type, streamId, n);
+    char *p = reserve(cryptor, queue, type, streamId, headerSize, n, nullptr);
+    if (n > 0)
+    {
+        memcpy(p, data, n);
+    }
+    commit(cryptor, queue, n);
+}
+
+void FrameBatcher::seal(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue)
+{
+    if (m_size == 0)
+    {
+        return;
+    }
+
+    uint8_t *record = (uint8_t *) m_record->data;
+    uint32_t recordSize = MsgUtil::packEncryptedData(cryptor, record, record + sizeof(DataHeader), m_size);
+    if (recordSize >= BUFFER_CHUNK_SIZE / 2)
+    {
+        queue.append(m_lane, std::move(m_record), recordSize); // a big record is handed over as it is
+    }
+    else
+    {
+        queue.append(m_lane, m_record->data, recordSize); // smaller ones are packed together, the chunk goes back
+        m_record.reset();
+    }
+    m_size = 0;
+}
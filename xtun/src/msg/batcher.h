@@ -0,0 +1,63 @@
+#ifndef __BATCHER_H__
+#define __BATCHER_H__
+
+#include <stddef.h>
+#include <memory>
+
+#include "msgdata.h"
+#include "codec.h"
+#include "recordqueue.h"
+
+/*
+ * the open record of a tunnel. frames (header + data) made during one loop stay
+ * here in plain text and are sealed as one record when the tunnel is flushed,
+ * so they share one header, one iv, one padding block and one encrypt call.
+ * a peer that reads one frame per record gets every frame sealed on its own.
+ * a tunnel has one batcher per lane of its record queue.
+ */
+class FrameBatcher
+{
+  private:
+    static size_t s_maxFramesSize; // for all batchers, the frames of a record never go beyond it
+
+    SEND_LANE m_lane;        // the records go into this lane
+    ChunkPtr m_record;       // header room + frames
+    size_t m_size{0};        // bytes of the frames
+    bool m_isBatching{true};
+    uint8_t m_frameVersion{FRAME_VERSION_FIXED};
+
+    // the frame between prepare and commit
+    int m_frameType{0};
+    uint32_t m_frameStreamId{0};
+    size_t m_frameHeaderSize{0};
+
+    char *reserve(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+                  size_t headerSize, size_t minSize, size_t *room);
+
+  public:
+    explicit FrameBatcher(SEND_LANE lane = LANE_DATA) : m_lane(lane) {}
+
+    // the bound of a record on the wire, header and padding included, set it before the loop starts.
+    // smaller records are decrypted and forwarded sooner by the peer
+    static void setMaxRecordSize(size_t recordSize);
+    static size_t maxRecordSize();
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    void setBatching(bool isBatching) { m_isBatching = isBatching; }
+    void setFrameVersion(uint8_t version) { m_frameVersion = version; }
+
+    // room for the data of a frame, at least minSize bytes, its size is put in room.
+    // the open record is sealed into the queue first if it can't take that much
+    char *prepare(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+                  size_t minSize, size_t *room);
+    // put the header before the n bytes filled in the room
+    void commit(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, size_t n);
+    void add(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue, int type, uint32_t streamId,
+             const void *data, size_t n);
+
+    // encrypt the frames as one record at the end of the lane
+    void seal(const std::unique_ptr<Cryptor> &cryptor, RecordQueue &queue);
+};
+
+#endif // __BATCHER_H__
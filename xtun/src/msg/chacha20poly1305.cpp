@@ -0,0 +1,372 @@
+#include "chacha20poly1305.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA_HAS_AVX2_KERNEL 1
+#endif
+
+#define CHACHA_BLOCK_LEN 64
+#define CHACHA_AVX2_BLOCKS 8
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t rotl32(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+#define QUARTER_ROUND(a, b, c, d)             \
+    a += b; d ^= a; d = rotl32(d, 16);        \
+    c += d; b ^= c; b = rotl32(b, 12);        \
+    a += b; d ^= a; d = rotl32(d, 8);         \
+    c += d; b ^= c; b = rotl32(b, 7);
+
+// "expand 32-byte k", key, block counter, nonce
+static void chachaInitState(uint32_t state[16], const uint8_t *key, uint32_t counter, const uint8_t *nonce)
+{
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+    {
+        state[4 + i] = load32(key + 4 * i);
+    }
+    state[12] = counter;
+    for (int i = 0; i < 3; i++)
+    {
+        state[13 + i] = load32(nonce + 4 * i);
+    }
+}
+
+static void chachaBlock(const uint32_t state[16], uint8_t out[CHACHA_BLOCK_LEN])
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12])
+        QUARTER_ROUND(x[1], x[5], x[9], x[13])
+        QUARTER_ROUND(x[2], x[6], x[10], x[14])
+        QUARTER_ROUND(x[3], x[7], x[11], x[15])
+        QUARTER_ROUND(x[0], x[5], x[10], x[15])
+        QUARTER_ROUND(x[1], x[6], x[11], x[12])
+        QUARTER_ROUND(x[2], x[7], x[8], x[13])
+        QUARTER_ROUND(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        store32(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+#ifdef CHACHA_HAS_AVX2_KERNEL
+
+bool hasChachaAvx2()
+{
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i rotl16x8(__m256i v)
+{
+    return _mm256_shuffle_epi8(v, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                                  13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+AVX2_TARGET static inline __m256i rotl8x8(__m256i v)
+{
+    return _mm256_shuffle_epi8(v, _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                                  14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3));
+}
+
+#define ROTL_X8(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define QUARTER_ROUND_X8(a, b, c, d)                                          \
+    a = _mm256_add_epi32(a, b); d = rotl16x8(_mm256_xor_si256(d, a));         \
+    c = _mm256_add_epi32(c, d); b = ROTL_X8(_mm256_xor_si256(b, c), 12);      \
+    a = _mm256_add_epi32(a, b); d = rotl8x8(_mm256_xor_si256(d, a));          \
+    c = _mm256_add_epi32(c, d); b = ROTL_X8(_mm256_xor_si256(b, c), 7);
+
+// rows are the same word of 8 blocks, turn them into 8 words of each block
+AVX2_TARGET static inline void transpose8x8(__m256i *v)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// xor 8 blocks of keystream into buf, the counter of the state is moved on
+AVX2_TARGET static void chachaXor8Blocks(uint32_t state[16], uint8_t *buf)
+{
+    __m256i init[16], x[16];
+    for (int i = 0; i < 16; i++)
+    {
+        init[i] = _mm256_set1_epi32((int) state[i]);
+    }
+    init[12] = _mm256_add_epi32(init[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    memcpy(x, init, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER_ROUND_X8(x[0], x[4], x[8], x[12])
+        QUARTER_ROUND_X8(x[1], x[5], x[9], x[13])
+        QUARTER_ROUND_X8(x[2], x[6], x[10], x[14])
+        QUARTER_ROUND_X8(x[3], x[7], x[11], x[15])
+        QUARTER_ROUND_X8(x[0], x[5], x[10], x[15])
+        QUARTER_ROUND_X8(x[1], x[6], x[11], x[12])
+        QUARTER_ROUND_X8(x[2], x[7], x[8], x[13])
+        QUARTER_ROUND_X8(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        x[i] = _mm256_add_epi32(x[i], init[i]);
+    }
+    transpose8x8(x);
+    transpose8x8(x + 8);
+
+    for (int b = 0; b < CHACHA_AVX2_BLOCKS; b++)
+    {
+        __m256i *lo = (__m256i *) (buf + b * CHACHA_BLOCK_LEN);
+        __m256i *hi = (__m256i *) (buf + b * CHACHA_BLOCK_LEN + 32);
+        _mm256_storeu_si256(lo, _mm256_xor_si256(_mm256_loadu_si256(lo), x[b]));
+        _mm256_storeu_si256(hi, _mm256_xor_si256(_mm256_loadu_si256(hi), x[8 + b]));
+    }
+    state[12] += CHACHA_AVX2_BLOCKS;
+}
+
+#else // the portable code only
+
+bool hasChachaAvx2()
+{
+    return false;
+}
+
+#endif
+
+void chachaXor(const uint8_t *key, const uint8_t *nonce, uint32_t counter, uint8_t *buf, uint32_t length)
+{
+    uint32_t state[16];
+    chachaInitState(state, key, counter, nonce);
+
+    uint32_t i = 0;
+#ifdef CHACHA_HAS_AVX2_KERNEL
+    if (hasChachaAvx2())
+    {
+        for (; i + CHACHA_AVX2_BLOCKS * CHACHA_BLOCK_LEN <= length; i += CHACHA_AVX2_BLOCKS * CHACHA_BLOCK_LEN)
+        {
+            chachaXor8Blocks(state, buf + i);
+        }
+    }
+#endif
+    for (; i < length; i += CHACHA_BLOCK_LEN)
+    {
+        uint8_t stream[CHACHA_BLOCK_LEN];
+        chachaBlock(state, stream);
+        state[12]++;
+
+        uint32_t n = length - i < CHACHA_BLOCK_LEN ? length - i : CHACHA_BLOCK_LEN;
+        for (uint32_t k = 0; k < n; k++)
+        {
+            buf[i + k] ^= stream[k];
+        }
+    }
+}
+
+/*
+ * poly1305 with 26 bits limbs, only 32x32->64 products so it is fast on 32 bits cpus too.
+ * the aead pads the message to 16 bytes, every block has the high bit
+ */
+struct Poly1305
+{
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+};
+
+static void poly1305Init(Poly1305 *st, const uint8_t key[32])
+{
+    st->r[0] = (load32(key + 0)) & 0x3ffffff;
+    st->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+    memset(st->h, 0, sizeof(st->h));
+    for (int i = 0; i < 4; i++)
+    {
+        st->pad[i] = load32(key + 16 + 4 * i);
+    }
+}
+
+static void poly1305Blocks(Poly1305 *st, const uint8_t *m, uint32_t length)
+{
+    const uint32_t hibit = 1 << 24;
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    for (; length >= 16; m += 16, length -= 16)
+    {
+        h0 += (load32(m + 0)) & 0x3ffffff;
+        h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32(m + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+        uint32_t c = (uint32_t) (d0 >> 26); h0 = (uint32_t) d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t) (d1 >> 26); h1 = (uint32_t) d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t) (d2 >> 26); h2 = (uint32_t) d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t) (d3 >> 26); h3 = (uint32_t) d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t) (d4 >> 26); h4 = (uint32_t) d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+// the last block zero padded to 16 bytes
+static void poly1305Padded(Poly1305 *st, const uint8_t *m, uint32_t length)
+{
+    uint32_t full = length & ~15u;
+    poly1305Blocks(st, m, full);
+    if (full < length)
+    {
+        uint8_t block[16] = {0};
+        memcpy(block, m + full, length - full);
+        poly1305Blocks(st, block, sizeof(block));
+    }
+}
+
+static void poly1305Finish(Poly1305 *st, uint8_t mac[POLY1305_TAG_LEN])
+{
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    uint32_t c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // h - p, taken when h >= p, in constant time
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f = (uint64_t) h0 + st->pad[0];
+    store32(mac + 0, (uint32_t) f);
+    f = (uint64_t) h1 + st->pad[1] + (f >> 32);
+    store32(mac + 4, (uint32_t) f);
+    f = (uint64_t) h2 + st->pad[2] + (f >> 32);
+    store32(mac + 8, (uint32_t) f);
+    f = (uint64_t) h3 + st->pad[3] + (f >> 32);
+    store32(mac + 12, (uint32_t) f);
+}
+
+// block 0 of the keystream is the one time poly1305 key, the data starts at block 1
+static void chachaPolyTag(const uint8_t *key, const uint8_t *nonce, const uint8_t *cipher, uint32_t length, uint8_t *tag)
+{
+    uint32_t state[16];
+    uint8_t block0[CHACHA_BLOCK_LEN];
+    chachaInitState(state, key, 0, nonce);
+    chachaBlock(state, block0);
+
+    Poly1305 st;
+    poly1305Init(&st, block0);
+    poly1305Padded(&st, cipher, length);
+
+    uint8_t lengths[16] = {0}; // no aad, then the length of the cipher text
+    uint64_t len = length;
+    for (int i = 0; i < 8; i++)
+    {
+        lengths[8 + i] = (uint8_t) (len >> (8 * i));
+    }
+    poly1305Blocks(&st, lengths, sizeof(lengths));
+    poly1305Finish(&st, tag);
+}
+
+void chachaPolyEncrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *buf, uint32_t length, uint8_t *tag)
+{
+    chachaXor(key, nonce, 1, buf, length);
+    chachaPolyTag(key, nonce, buf, length, tag);
+}
+
+bool chachaPolyDecrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *buf, uint32_t length, const uint8_t *tag)
+{
+    uint8_t expected[POLY1305_TAG_LEN];
+    chachaPolyTag(key, nonce, buf, length, expected);
+
+    uint8_t diff = 0; // constant time compare
+    for (int i = 0; i < POLY1305_TAG_LEN; i++)
+    {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0)
+    {
+        return false;
+    }
+
+    chachaXor(key, nonce, 1, buf, length);
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef __CHACHA20POLY1305_H__
+#define __CHACHA20POLY1305_H__
+
+#include <stdint.h>
+
+#define CHACHA_KEY_LEN 32
+#define CHACHA_NONCE_LEN 12
+#define POLY1305_TAG_LEN 16
+
+/*
+ * chacha20-poly1305 aead of rfc 8439, no aad.
+ * portable code, the keystream uses an 8 blocks avx2 kernel when the cpu has it.
+ */
+bool hasChachaAvx2(); // checked once with cpuid
+
+// xor the chacha20 keystream from block counter on into buf
+void chachaXor(const uint8_t *key, const uint8_t *nonce, uint32_t counter, uint8_t *buf, uint32_t length);
+
+void chachaPolyEncrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *buf, uint32_t length, uint8_t *tag);
+// the tag is checked before anything is decrypted, a forged record is left as it is
+bool chachaPolyDecrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *buf, uint32_t length, const uint8_t *tag);
+
+#endif // __CHACHA20POLY1305_H__
@@ -0,0 +1,198 @@
+#include <netinet/in.h>
+#include <algorithm>
+#include <cstring>
+
+#include "codec.h"
+
+
+static size_t varintSize(uint32_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// width >= varintSize(value), the high groups go first, padded with empty continuation bytes
+static char *putVarint(char *out, uint32_t value, size_t width)
+{
+    for (size_t i = width - 1; i > 0; i--)
+    {
+        uint32_t group = i * 7 < 32 ? (value >> (i * 7)) & 0x7f : 0;
+        *out++ = (char) (group | 0x80);
+    }
+    *out++ = (char) (value & 0x7f);
+    return out;
+}
+
+static bool getVarint(const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 5 && *p < end; i++)
+    {
+        uint8_t byte = *(*p)++;
+        if (result > (UINT32_MAX >> 7))
+        {
+            return false; // more than 32 bits
+        }
+        result = (result << 7) | (byte & 0x7f);
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t FrameCodec::headerSize(uint8_t version, int type, uint32_t streamId, uint32_t size)
+{
+    if (version == FRAME_VERSION_FIXED)
+    {
+        return sizeof(MsgData);
+    }
+    return varintSize(type) + varintSize(streamId) + varintSize(size);
+}
+
+void FrameCodec::encodeHeader(uint8_t version, char *out, size_t headerSize, int type, uint32_t streamId, uint32_t size)
+{
+    if (version == FRAME_VERSION_FIXED)
+    {
+        MsgData msgData;
+        msgData.type = type;
+        msgData.size = size;
+        msgData.userId = streamId;
+        memcpy(out, &msgData, sizeof(msgData));
+        return;
+    }
+
+    size_t typeSize = varintSize(type);
+    size_t streamSize = varintSize(streamId);
+    out = putVarint(out, type, typeSize);
+    out = putVarint(out, streamId, streamSize);
+    putVarint(out, size, headerSize - typeSize - streamSize);
+}
+
+bool FrameCodec::decode(uint8_t version, const char *buf, size_t len, Frame *frame, size_t *frameSize)
+{
+    frame->version = version;
+    if (version == FRAME_VERSION_FIXED)
+    {
+        MsgData msgData;
+        if (len < sizeof(MsgData))
+        {
+            return false;
+        }
+        memcpy(&msgData, buf, sizeof(msgData));
+        if (msgData.size < 0 || static_cast<size_t>(msgData.size) > len - sizeof(MsgData))
+        {
+            return false;
+        }
+        frame->type = msgData.type;
+        frame->streamId = msgData.userId;
+        frame->data = buf + sizeof(MsgData);
+        frame->size = msgData.size;
+        *frameSize = sizeof(MsgData) + msgData.size;
+        return true;
+    }
+
+    const uint8_t *p = (const uint8_t *) buf;
+    const uint8_t *end = p + len;
+    uint32_t type, streamId, size;
+    if (!getVarint(&p, end, &type) || !getVarint(&p, end, &streamId) || !getVarint(&p, end, &size)
+        || size > static_cast<size_t>(end - p))
+    {
+        return false;
+    }
+    frame->type = static_cast<int>(type);
+    frame->streamId = streamId;
+    frame->data = (const char *) p;
+    frame->size = size;
+    *frameSize = (const char *) p + size - buf;
+    return true;
+}
+
+size_t FrameCodec::encodeNewProxy(uint8_t version, const NewProxyMsg &msg, char *out)
+{
+    if (version == FRAME_VERSION_FIXED)
+    {
+        memcpy(out, &msg, sizeof(msg));
+        return sizeof(msg);
+    }
+    uint32_t userId = htonl(msg.userId);
+    uint16_t remotePort = htons(msg.remotePort);
+    memcpy(out, &userId, sizeof(userId));
+    memcpy(out + sizeof(userId), &remotePort, sizeof(remotePort));
+    return sizeof(userId) + sizeof(remotePort);
+}
+
+bool FrameCodec::decodeNewProxy(const Frame &frame, NewProxyMsg *msg)
+{
+    if (frame.version == FRAME_VERSION_FIXED)
+    {
+        memset(msg, 0, sizeof(*msg));
+        memcpy(msg, frame.data, std::min(static_cast<size_t>(frame.size), sizeof(*msg)));
+        return true;
+    }
+    uint32_t userId;
+    uint16_t remotePort;
+    if (frame.size < sizeof(userId) + sizeof(remotePort))
+    {
+        return false;
+    }
+    memcpy(&userId, frame.data, sizeof(userId));
+    memcpy(&remotePort, frame.data + sizeof(userId), sizeof(remotePort));
+    msg->userId = ntohl(userId);
+    msg->remotePort = ntohs(remotePort);
+    return true;
+}
+
+size_t FrameCodec::encodeReplyNewProxy(uint8_t version, const ReplyNewProxyMsg &msg, char *out)
+{
+    if (version == FRAME_VERSION_FIXED)
+    {
+        memcpy(out, &msg, sizeof(msg));
+        return sizeof(msg);
+    }
+    *out = msg.isSuccess ? 1 : 0;
+    return 1;
+}
+
+bool FrameCodec::decodeReplyNewProxy(const Frame &frame, ReplyNewProxyMsg *msg)
+{
+    if (frame.size < 1)
+    {
+        return false;
+    }
+    msg->isSuccess = frame.data[0] != 0;
+    return true;
+}
+
+size_t FrameCodec::encodeWindowUpdate(uint8_t version, const WindowUpdateMsg &msg, char *out)
+{
+    if (version == FRAME_VERSION_FIXED)
+    {
+        memcpy(out, &msg, sizeof(msg));
+        return sizeof(msg);
+    }
+    uint32_t increment = htonl(msg.increment);
+    memcpy(out, &increment, sizeof(increment));
+    return sizeof(increment);
+}
+
+bool FrameCodec::decodeWindowUpdate(const Frame &frame, WindowUpdateMsg *msg)
+{
+    if (frame.size < sizeof(msg->increment))
+    {
+        return false;
+    }
+    memcpy(&msg->increment, frame.data, sizeof(msg->increment));
+    if (frame.version != FRAME_VERSION_FIXED)
+    {
+        msg->increment = ntohl(msg->increment);
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgdata.h"
+
+// type, stream id and length as varints of 5 bytes at most
+const size_t MAX_FRAME_HEADER_SIZE = 16;
+
+/*
+ * one message of a decrypted record, data points into the record and is only
+ * valid until the next record is received, unless a reference of the record is kept.
+ */
+struct Frame
+{
+    uint8_t version;    // FRAME_VERSION it was decoded with
+    int type;
+    uint32_t streamId;  // the user id, 0 for the tunnel itself
+    const char *data;
+    uint32_t size;
+    const SharedChunk *record{nullptr}; // the chunk data is in, set by the receiver
+};
+
+/*
+ * wire codec of the messages in a record.
+ * FRAME_VERSION_FIXED: MsgData + data, host byte order, kept for old peers.
+ * FRAME_VERSION_VARINT: varint(type) varint(stream id) varint(size) + data, a keystroke
+ * costs 3 or 4 bytes of header instead of 12. varints are base 128 in network byte order,
+ * the most significant group first and 0x80 on all bytes but the last. a header reserved
+ * before the size is known pads it with leading 0x80 bytes.
+ */
+class FrameCodec
+{
+public:
+    static size_t headerSize(uint8_t version, int type, uint32_t streamId, uint32_t size); // the shortest
+    // write a header of exactly headerSize bytes, which may be more than needed
+    static void encodeHeader(uint8_t version, char *out, size_t headerSize, int type, uint32_t streamId, uint32_t size);
+    // the frame at the front of buf, false if it is broken or runs over len
+    static bool decode(uint8_t version, const char *buf, size_t len, Frame *frame, size_t *frameSize);
+
+    // control payloads, out must take sizeof the msg
+    static size_t encodeNewProxy(uint8_t version, const NewProxyMsg &msg, char *out);
+    static bool decodeNewProxy(const Frame &frame, NewProxyMsg *msg);
+    static size_t encodeReplyNewProxy(uint8_t version, const ReplyNewProxyMsg &msg, char *out);
+    static bool decodeReplyNewProxy(const Frame &frame, ReplyNewProxyMsg *msg);
+    static size_t encodeWindowUpdate(uint8_t version, const WindowUpdateMsg &msg, char *out);
+    static bool decodeWindowUpdate(const Frame &frame, WindowUpdateMsg *msg);
+};
+
+#endif // __CODEC_H__
@@ -3,18 +3,17 @@
 #include <netinet/in.h>
 #include <string.h>
 
+#include "drbg.h"
+
 
 void genRandomIv(uint8_t *buf, uint32_t length)
 {
-    srand(time(NULL));
-
-    for (uint32_t i = 0; i < length; i++)
-    {
-        buf[i] = rand() % UINT8_MAX;
-    }
+    Drbg::local().fill(buf, length);
 }
 
-Cryptor::Cryptor(CRYPT_METHOD method, uint8_t *key) : m_method(method)
+static_assert(CHACHA_KEY_LEN == AES_KEYLEN, "chacha20 takes the same key");
+
+Cryptor::Cryptor(CRYPT_METHOD method, uint8_t *key) : m_useAesni(hasAesni()), m_method(method)
 {
     if (key == nullptr)
     {
@@ -23,12 +22,57 @@ Cryptor::Cryptor(CRYPT_METHOD method, uint8_t *key) : m_method(method)
 
     memcpy(m_key, key, AES_KEYLEN);
     AES_init_ctx(&m_ctx, key);
+    if (m_useAesni)
+    {
+        aesniExpandKey(key, &m_aesniKey);
+    }
+    if (m_method == CRYPT_GCM)
+    {
+        aesniGcmInit(&m_aesniKey);
+    }
+    if (isAead())
+    {
+        resetNonceSalt();
+    }
 }
 
 Cryptor::~Cryptor()
 {
 }
 
+bool Cryptor::isSupported(CRYPT_METHOD method)
+{
+    if (method == CRYPT_GCM)
+    {
+        return hasAesniGcm();
+    }
+    return true;
+}
+
+// the salt tells apart the nonces of two processes sharing the key
+void Cryptor::resetNonceSalt()
+{
+    genRandomIv(m_nonceSalt, sizeof(m_nonceSalt));
+}
+
+void Cryptor::nextIv(uint8_t *iv)
+{
+    if (!isAead())
+    {
+        genRandomIv(iv, AES_BLOCKLEN);
+        return;
+    }
+
+    if (++m_nonceCounter == 0)
+    {
+        resetNonceSalt();
+    }
+    uint32_t counter = htonl(m_nonceCounter);
+    memcpy(iv, m_nonceSalt, sizeof(m_nonceSalt));
+    memcpy(iv + sizeof(m_nonceSalt), &counter, sizeof(counter));
+    memset(iv + GCM_NONCE_LEN, 0, AES_BLOCKLEN - GCM_NONCE_LEN);
+}
+
 uint32_t Cryptor::PKCS7_padding(uint8_t *buf, uint32_t length)
 {
     if (buf == nullptr)
@@ -46,9 +90,50 @@ uint32_t Cryptor::PKCS7_padding(uint8_t *buf, uint32_t length)
     return length + padding_len;
 }
 
+uint32_t Cryptor::PKCS7_unpadding(uint8_t *buf, uint32_t length)
+{
+    uint8_t padding_len = buf[length - 1];
+    if (padding_len == 0 || padding_len > AES_BLOCKLEN)
+    {
+        return DECRYPT_ERR;
+    }
+
+    uint8_t diff = 0;
+    for (uint32_t i = length - padding_len; i < length; i++)
+    {
+        diff |= buf[i] ^ padding_len;
+    }
+    return diff == 0 ? length - padding_len : DECRYPT_ERR;
+}
+
 uint32_t Cryptor::encrypt(uint8_t *iv, uint8_t *buf, uint32_t length)
 {
+    if (m_method == CRYPT_GCM)
+    {
+        // no padding, the tag is put right after the cipher text
+        aesniGcmEncrypt(&m_aesniKey, iv, buf, length, buf + length);
+        return length + GCM_TAG_LEN;
+    }
+    if (m_method == CRYPT_CHACHA20_POLY1305)
+    {
+        chachaPolyEncrypt(m_key, iv, buf, length, buf + length);
+        return length + POLY1305_TAG_LEN;
+    }
+
     uint32_t res_len = PKCS7_padding(buf, length);
+    if (m_useAesni)
+    {
+        if (m_method == CRYPT_CBC)
+        {
+            aesniCbcEncrypt(&m_aesniKey, iv, buf, res_len);
+        }
+        else if (m_method == CRYPT_CTR)
+        {
+            aesniCtrXcrypt(&m_aesniKey, iv, buf, res_len);
+        }
+        return res_len;
+    }
+
     AES_ctx_set_iv(&m_ctx, iv);
 
     if (m_method == CRYPT_CBC)
@@ -65,6 +150,42 @@ uint32_t Cryptor::encrypt(uint8_t *iv, uint8_t *buf, uint32_t length)
 
 uint32_t Cryptor::decrypt(uint8_t *iv, uint8_t *buf, uint32_t length)
 {
+    if (m_method == CRYPT_GCM)
+    {
+        if (length < GCM_TAG_LEN)
+        {
+            return DECRYPT_ERR;
+        }
+        uint32_t plainLen = length - GCM_TAG_LEN;
+        return aesniGcmDecrypt(&m_aesniKey, iv, buf, plainLen, buf + plainLen) ? plainLen : DECRYPT_ERR;
+    }
+    if (m_method == CRYPT_CHACHA20_POLY1305)
+    {
+        if (length < POLY1305_TAG_LEN)
+        {
+            return DECRYPT_ERR;
+        }
+        uint32_t plainLen = length - POLY1305_TAG_LEN;
+        return chachaPolyDecrypt(m_key, iv, buf, plainLen, buf + plainLen) ? plainLen : DECRYPT_ERR;
+    }
+    if (length == 0 || length % AES_BLOCKLEN != 0)
+    {
+        return DECRYPT_ERR;
+    }
+
+    if (m_useAesni)
+    {
+        if (m_method == CRYPT_CBC)
+        {
+            aesniCbcDecrypt(&m_aesniKey, iv, buf, length);
+        }
+        else if (m_method == CRYPT_CTR)
+        {
+            aesniCtrXcrypt(&m_aesniKey, iv, buf, length);
+        }
+        return PKCS7_unpadding(buf, length);
+    }
+
     AES_ctx_set_iv(&m_ctx, iv);
 
     if (m_method == CRYPT_CBC)
@@ -76,5 +197,5 @@ uint32_t Cryptor::decrypt(uint8_t *iv, uint8_t *buf, uint32_t length)
         AES_CTR_xcrypt_buffer(&m_ctx, buf, length);
     }
 
-    return length - buf[length - 1];
+    return PKCS7_unpadding(buf, length);
 }
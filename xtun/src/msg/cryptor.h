@@ -6,29 +6,50 @@
 #include <stdlib.h>
 
 #include "../third_part/aes.hpp"
+#include "aesni.h"
+#include "chacha20poly1305.h"
 
 enum CRYPT_METHOD
 {
     CRYPT_CBC,
-    CRYPT_CTR
+    CRYPT_CTR,
+    CRYPT_GCM,              // aead, the tag follows the cipher text, needs AES-NI and PCLMULQDQ
+    CRYPT_CHACHA20_POLY1305 // aead like gcm, fast without AES instructions
 };
 
+const uint32_t DECRYPT_ERR = UINT32_MAX; // bad padding or forged record
+
 void genRandomIv(uint8_t *buf, uint32_t length);
 
 class Cryptor
 {
 private:
     struct AES_ctx m_ctx;
+    AesniKey m_aesniKey;
     uint8_t m_key[AES_KEYLEN];
+    bool m_useAesni; // picked at runtime, tiny-AES when the cpu has no AES-NI
 
     CRYPT_METHOD m_method;
 
+    // an aead must never reuse a nonce: random salt + counter, a new salt when the counter wraps
+    uint8_t m_nonceSalt[GCM_NONCE_LEN - sizeof(uint32_t)];
+    uint32_t m_nonceCounter{0};
+
     uint32_t PKCS7_padding(uint8_t *buf, uint32_t length);
+    uint32_t PKCS7_unpadding(uint8_t *buf, uint32_t length);
+    void resetNonceSalt();
 
 public:
-    Cryptor(CRYPT_METHOD method, uint8_t *key);
+    Cryptor(CRYPT_METHOD method, uint8_t *key); // method must be supported, see isSupported
     ~Cryptor();
 
+    static bool isSupported(CRYPT_METHOD method);
+
+    CRYPT_METHOD method() const { return m_method; }
+    bool isAead() const { return m_method == CRYPT_GCM || m_method == CRYPT_CHACHA20_POLY1305; }
+    void nextIv(uint8_t *iv); // AES_BLOCKLEN bytes for the next record
+
+    // encrypt returns the size of the cipher text, decrypt the size of the plain text or DECRYPT_ERR
     uint32_t encrypt(uint8_t *iv, uint8_t *buf, uint32_t length);
     uint32_t decrypt(uint8_t *iv, uint8_t *buf, uint32_t length);
 };
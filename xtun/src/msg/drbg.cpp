@@ -0,0 +1,123 @@
+#include "drbg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+// the kernel pool, /dev/urandom if getrandom is missing. false if neither gives all the bytes
+static bool osRandom(uint8_t *buf, size_t length)
+{
+    size_t got = 0;
+    while (got < length)
+    {
+        ssize_t n = getrandom(buf + got, length - got, 0);
+        if (n > 0)
+        {
+            got += n;
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+    if (got == length)
+    {
+        return true;
+    }
+
+    int fd = open("/dev/urandom", O_RDONLY);
+    while (fd != -1 && got < length)
+    {
+        ssize_t n = read(fd, buf + got, length - got);
+        if (n <= 0 && errno != EINTR)
+        {
+            break;
+        }
+        got += n > 0 ? n : 0;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return got == length;
+}
+
+Drbg::Drbg()
+{
+    memset(m_key, 0, sizeof(m_key));
+    seed();
+}
+
+Drbg::~Drbg()
+{
+    memset(m_key, 0, sizeof(m_key));
+    memset(m_batch, 0, sizeof(m_batch));
+}
+
+Drbg &Drbg::local()
+{
+    thread_local Drbg drbg;
+    return drbg;
+}
+
+// new entropy is xored into the key, the old state still counts if the kernel fails us.
+// without a first seed the key would be known to all, keys and tokens must not come from it
+void Drbg::seed()
+{
+    uint8_t entropy[CHACHA_KEY_LEN] = {0};
+    if (!osRandom(entropy, sizeof(entropy)))
+    {
+        if (!m_isSeeded)
+        {
+            fprintf(stderr, "drbg: no entropy from getrandom or /dev/urandom: %d\n", errno);
+            abort();
+        }
+        return; // tried again at the next refill
+    }
+    m_isSeeded = true;
+    for (size_t i = 0; i < sizeof(m_key); i++)
+    {
+        m_key[i] ^= entropy[i];
+    }
+    memset(entropy, 0, sizeof(entropy));
+    m_sinceSeed = 0;
+    m_pos = DRBG_BATCH_SIZE; // drop the rest of the batch made with the old key
+}
+
+void Drbg::refill()
+{
+    static const uint8_t nonce[CHACHA_NONCE_LEN] = {0}; // a key is used once, the nonce doesn't matter
+
+    if (m_sinceSeed >= DRBG_RESEED_INTERVAL)
+    {
+        seed();
+    }
+
+    memset(m_batch, 0, sizeof(m_batch));
+    chachaXor(m_key, nonce, 0, m_batch, sizeof(m_batch));
+    memcpy(m_key, m_batch, sizeof(m_key));
+    memset(m_batch, 0, sizeof(m_key));
+    m_pos = sizeof(m_key);
+}
+
+void Drbg::fill(uint8_t *buf, size_t length)
+{
+    while (length > 0)
+    {
+        if (m_pos == DRBG_BATCH_SIZE)
+        {
+            refill();
+        }
+        size_t n = DRBG_BATCH_SIZE - m_pos < length ? DRBG_BATCH_SIZE - m_pos : length;
+        memcpy(buf, m_batch + m_pos, n);
+        memset(m_batch + m_pos, 0, n); // given out, don't keep it
+        m_pos += n;
+        m_sinceSeed += n;
+        buf += n;
+        length -= n;
+    }
+}
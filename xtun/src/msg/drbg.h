@@ -0,0 +1,40 @@
+#ifndef __DRBG_H__
+#define __DRBG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chacha20poly1305.h"
+
+const size_t DRBG_BATCH_SIZE = 1024 * 4;          // keystream made per refill
+const size_t DRBG_RESEED_INTERVAL = 1024 * 1024;  // bytes given out before new entropy is mixed in
+
+/*
+ * chacha20 random generator, one per thread so the reactors never lock for it.
+ * seeded from getrandom(), the first 32 bytes of every batch become the next key
+ * so bytes already given out can't be found again from the state.
+ */
+class Drbg
+{
+  private:
+    uint8_t m_key[CHACHA_KEY_LEN];
+    uint8_t m_batch[DRBG_BATCH_SIZE];
+    size_t m_pos{DRBG_BATCH_SIZE};
+    size_t m_sinceSeed{0};
+    bool m_isSeeded{false}; // got entropy from the kernel at least once
+
+    Drbg();
+    void seed();
+    void refill();
+
+  public:
+    Drbg(const Drbg &) = delete;
+    Drbg &operator=(const Drbg &) = delete;
+    ~Drbg();
+
+    static Drbg &local(); // the generator of this thread
+
+    void fill(uint8_t *buf, size_t length);
+};
+
+#endif // __DRBG_H__
@@ -18,10 +18,31 @@ uint32_t MsgUtil::packEncryptedData(const std::unique_ptr<Cryptor>& cryptor, uin
     DataHeader dataHeader;
     size_t headerLen = sizeof(DataHeader);
 
-    genRandomIv(dataHeader.iv, sizeof(dataHeader.iv));
-    memcpy(buf + headerLen, data, dataSize);
+    cryptor->nextIv(dataHeader.iv);
+    if (data != buf + headerLen)
+    {
+        memmove(buf + headerLen, data, dataSize); // data may be in buf already
+    }
     dataHeader.dataLen = cryptor->encrypt(dataHeader.iv, buf + headerLen, dataSize);
     memcpy(buf, &dataHeader, headerLen);
 
     return dataHeader.dataLen + headerLen;
 }
+
+bool MsgUtil::isValidRecordSize(uint32_t dataLen)
+{
+    // the block alignment and padding are checked by the cryptor of the record
+    return dataLen > 0 && dataLen <= BUFFER_CHUNK_SIZE - sizeof(DataHeader);
+}
+
+bool MsgUtil::isControlMsg(int type)
+{
+    return type == MSGTYPE_HEARTBEAT || type == MSGTYPE_NEW_PROXY || type == MSGTYPE_REPLY_NEW_PROXY
+        || type == MSGTYPE_WINDOW_UPDATE;
+}
+
+bool MsgUtil::isStreamMsg(int type)
+{
+    return type == MSGTYPE_REPLY_NEW_PROXY || type == MSGTYPE_CLIENT_APP_DATA || type == MSGTYPE_LOCAL_DOWN
+        || type == MSGTYPE_USER_DOWN || type == MSGTYPE_WINDOW_UPDATE;
+}
@@ -4,10 +4,26 @@
 #include <memory>
 
 #include "../third_part/aes.h"
+#include "../net/buffer.h"
 #include "cryptor.h"
 
 const size_t PW_MAX_LEN = 32; // len of md5
-const size_t MAX_BUF_SIZE = 1024 * 1024 * 5; // 1m
+const size_t MAX_BUF_SIZE = 1024 * 1024 * 5; // 每个连接最多缓存的数据
+const size_t READ_BUDGET_PER_EVENT = 1024 * 256; // bytes read from one socket per wakeup, others need their turn
+
+// the streams of a tunnel share it by deficit round robin, a turn reads up to weight * DRR_QUANTUM bytes of a stream.
+// they are read into the tunnel only below the high water mark, the rest waits in their sockets,
+// so a bulk stream can't queue much in front of an interactive one
+const size_t TUNNEL_HIGH_WATER_MARK = 1024 * 256;
+const size_t DRR_QUANTUM = 1024 * 16;
+const unsigned short MAX_PROXY_WEIGHT = 64; // weight of a proxy section, 1 by default
+
+// flow control of each user stream, like the windows of http2.
+// a side sends at most the window of a stream, the peer gives credit back after writing the data out
+const uint32_t DEFAULT_STREAM_WINDOW = 1024 * 256;
+const uint32_t WINDOW_UPDATE_THRESHOLD = DEFAULT_STREAM_WINDOW / 2; // give credit back in batches
+// peers before FRAME_VERSION_VARINT never give credit back, their streams are not limited
+const uint32_t UNLIMITED_STREAM_WINDOW = UINT32_MAX;
 
 
 enum MSGTYPE
@@ -17,7 +33,17 @@ enum MSGTYPE
     MSGTYPE_REPLY_NEW_PROXY,    // 客户端-》 服务端， 返回是否成功建立连接
     MSGTYPE_CLIENT_APP_DATA,    // 客户端发来的应用数据
     MSGTYPE_LOCAL_DOWN,         // 本地应用断开连接
-    MSGTYPE_USER_DOWN           // 用户断开连接
+    MSGTYPE_USER_DOWN,          // 用户断开连接
+    MSGTYPE_WINDOW_UPDATE,      // 对端已经写出的数据量，可以继续发送这么多
+    MSGTYPE_COUNT
+};
+
+// 认证时协商的消息编码, 见codec.h
+enum FRAME_VERSION
+{
+    FRAME_VERSION_FIXED = 0,    // MsgData结构体 + 数据, 旧版本
+    FRAME_VERSION_VARINT = 1,   // 变长头(类型, 流id, 长度) + 数据, 整数都是网络字节序
+    FRAME_VERSION_LATEST = FRAME_VERSION_VARINT
 };
 
 struct MsgData
@@ -38,6 +64,11 @@ struct ReplyNewProxyMsg
     bool isSuccess;
 };
 
+struct WindowUpdateMsg
+{
+    uint32_t increment; // 增加的发送窗口
+};
+
 struct DataHeader
 {
     uint32_t dataLen{0};
@@ -49,11 +80,52 @@ struct DataHeader
     }
 };
 
+// 一个加密记录(头 + 密文)要放进一个chunk, 密文最多比明文多一个块(cbc的填充或aead的tag)
+const size_t MAX_RECORD_FRAMES_SIZE = BUFFER_CHUNK_SIZE - sizeof(DataHeader) - AES_BLOCKLEN;
+const size_t MIN_RECORD_SIZE = 1024; // 配置的记录大小的下限, 上限是一个chunk
+const size_t MIN_RECORD_ROOM = 1024 * 4; // 接收用户数据时记录剩余空间小于这个就封上, 换新的记录
+
 
 const char HEARTBEAT_CLIENT_MSG[] = "ping";
 const char HEARTBEAT_SERVER_MSG[] = "pong";
 
 const char AUTH_TOKEN[] = "DGPJCY";
+const char DATA_BIND_TOKEN[] = "XTUNDATA";
+const size_t SESSION_TOKEN_LEN = 8;
+
+// 用户数据怎么走
+enum DATA_MODE
+{
+    DATA_MODE_TUNNEL = 0,   // 加密后和控制消息一起走隧道
+    DATA_MODE_SPLICE = 1,   // cipher = none: 每个用户一条明文数据连接, 两端用splice转发, 网络本身要可信
+};
+
+// 认证时协商之后记录的加密方式和消息编码, 认证的两条记录本身总是cbc
+// 新字段只加在末尾, 对端没发的字段当作0; 旧的client只发密码, 用cbc; 旧的client只比较回复的AUTH_TOKEN部分
+struct AuthRequestMsg
+{
+    char password[PW_MAX_LEN];
+    uint8_t cryptMethods;      // client支持的方式, 1 << CRYPT_METHOD
+    uint8_t frameVersion;      // client支持的最高编码
+    uint8_t dataMode;          // client想要的DATA_MODE
+};
+
+struct AuthReplyMsg
+{
+    char token[sizeof(AUTH_TOKEN)];
+    uint8_t cryptMethod;       // server选中的方式
+    uint8_t frameVersion;      // 双方都支持的最高编码
+    uint8_t dataMode;          // server同意的DATA_MODE
+    uint8_t sessionToken[SESSION_TOKEN_LEN]; // DATA_MODE_SPLICE时数据连接用它找到自己的client
+};
+
+// DATA_MODE_SPLICE时数据连接连上控制端口后的第一个记录, 和认证一样用cbc, 之后全是这个用户的明文数据
+struct DataBindMsg
+{
+    char token[sizeof(DATA_BIND_TOKEN)];
+    uint8_t sessionToken[SESSION_TOKEN_LEN];
+    uint32_t userId;           // 网络字节序
+};
 
 class MsgUtil
 {
@@ -64,6 +136,11 @@ public:
 
     static uint32_t ensureEncryptedDataSize(uint32_t dataLen);
     static uint32_t packEncryptedData(const std::unique_ptr<Cryptor>& cryptor, uint8_t *buf, uint8_t *data, uint32_t dataSize);
+    static bool isValidRecordSize(uint32_t dataLen);
+    // 控制消息走优先通道, 流的DOWN要跟在它的数据后面, 不算
+    static bool isControlMsg(int type);
+    // 属于某个用户流的消息, 流已经关掉时丢弃
+    static bool isStreamMsg(int type);
 };
 
 #endif
\ No newline at end of file
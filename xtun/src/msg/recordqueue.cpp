@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <utility>
+
+#include "recordqueue.h"
+
+
+void RecordQueue::append(SEND_LANE lane, const char *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    m_lanes[lane].append(data, len);
+    if (lane == LANE_DATA)
+    {
+        m_dataRecords.push_back(len);
+    }
+}
+
+void RecordQueue::append(SEND_LANE lane, ChunkPtr chunk, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    m_lanes[lane].append(std::move(chunk), len);
+    if (lane == LANE_DATA)
+    {
+        m_dataRecords.push_back(len);
+    }
+}
+
+int RecordQueue::peek(struct iovec *iov, int maxIov, size_t *len) const
+{
+    if (m_dataSent > 0)
+    {
+        // only the rest of the record partly sent, the control records can go right after it
+        int count = m_lanes[LANE_DATA].peek(iov, maxIov, len);
+        size_t left = m_dataRecords.front() - m_dataSent;
+        size_t total = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (total + iov[i].iov_len >= left)
+            {
+                iov[i].iov_len = left - total;
+                *len = left;
+                return i + 1;
+            }
+            total += iov[i].iov_len;
+        }
+        return count;
+    }
+
+    int count = m_lanes[LANE_CONTROL].peek(iov, maxIov, len);
+    size_t dataLen;
+    count += m_lanes[LANE_DATA].peek(iov + count, maxIov - count, &dataLen);
+    *len += dataLen;
+    return count;
+}
+
+void RecordQueue::consume(size_t n)
+{
+    if (m_dataSent > 0)
+    {
+        size_t len = std::min(n, m_dataRecords.front() - m_dataSent);
+        consumeData(len);
+        n -= len;
+    }
+
+    size_t len = std::min(n, m_lanes[LANE_CONTROL].size());
+    m_lanes[LANE_CONTROL].consume(len);
+    consumeData(n - len);
+}
+
+void RecordQueue::consumeData(size_t n)
+{
+    m_lanes[LANE_DATA].consume(n);
+    while (n > 0 && !m_dataRecords.empty())
+    {
+        size_t left = m_dataRecords.front() - m_dataSent;
+        if (n < left)
+        {
+            m_dataSent += n;
+            return;
+        }
+        n -= left;
+        m_dataRecords.pop_front();
+        m_dataSent = 0;
+    }
+}
+
+void RecordQueue::takeAll(ChainBuffer &out)
+{
+    if (m_dataSent > 0)
+    {
+        // the rest of a record partly sent can't wait, the control records go after all the data then
+        out.append(std::move(m_lanes[LANE_DATA]));
+    }
+    out.append(std::move(m_lanes[LANE_CONTROL]));
+    out.append(std::move(m_lanes[LANE_DATA]));
+    m_dataRecords.clear();
+    m_dataSent = 0;
+}
+
+void RecordQueue::clear()
+{
+    for (ChainBuffer &lane : m_lanes)
+    {
+        lane.clear();
+    }
+    m_dataRecords.clear();
+    m_dataSent = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __RECORDQUEUE_H__
+#define __RECORDQUEUE_H__
+
+#include <stddef.h>
+#include <deque>
+
+#include <sys/uio.h>
+
+#include "../net/buffer.h"
+
+enum SEND_LANE
+{
+    LANE_CONTROL, // heartbeats, stream setup and window updates, sent first
+    LANE_DATA,    // app data and the stream downs that must follow it
+    LANE_COUNT
+};
+
+/*
+ * sealed records of a tunnel waiting for its socket, in two lanes. a control
+ * record goes ahead of all the data records not started yet, so it waits at most
+ * for the rest of one data record instead of the whole queue. a record partly
+ * sent is always finished first, the peer needs it in one piece.
+ */
+class RecordQueue
+{
+  private:
+    ChainBuffer m_lanes[LANE_COUNT];
+    std::deque<size_t> m_dataRecords; // size of each data record
+    size_t m_dataSent{0};             // bytes of the first data record already sent
+
+    void consumeData(size_t n);
+
+  public:
+    size_t size() const { return m_lanes[LANE_CONTROL].size() + m_lanes[LANE_DATA].size(); }
+    bool empty() const { return size() == 0; }
+
+    // one whole record
+    void append(SEND_LANE lane, const char *data, size_t len);
+    void append(SEND_LANE lane, ChunkPtr chunk, size_t len); // no copy
+
+    // the next bytes to send as at most maxIov segments for sendmsg, returns the count and puts their size in len
+    int peek(struct iovec *iov, int maxIov, size_t *len) const;
+    void consume(size_t n);
+    // move all the bytes to out in the order they must be sent, the queue is left empty
+    void takeAll(ChainBuffer &out);
+    void clear();
+};
+
+#endif // __RECORDQUEUE_H__
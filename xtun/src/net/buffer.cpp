@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "buffer.h"
+
+
+static thread_local bool t_isPoolDestroyed = false; // no destructor, still readable after the pool is gone
+
+ChunkPool::~ChunkPool()
+{
+    t_isPoolDestroyed = true;
+    for (BufferChunk *chunk : m_freeChunks)
+    {
+        delete chunk;
+    }
+}
+
+ChunkPool *ChunkPool::local()
+{
+    thread_local ChunkPool pool;
+    return t_isPoolDestroyed ? nullptr : &pool;
+}
+
+BufferChunk *ChunkPool::acquire()
+{
+    if (m_freeChunks.empty())
+    {
+        return new BufferChunk;
+    }
+    BufferChunk *chunk = m_freeChunks.back();
+    m_freeChunks.pop_back();
+    return chunk;
+}
+
+void ChunkPool::release(BufferChunk *chunk)
+{
+    if (chunk == nullptr)
+    {
+        return;
+    }
+    if (m_freeChunks.size() >= MAX_FREE_CHUNKS)
+    {
+        delete chunk;
+        return;
+    }
+    m_freeChunks.push_back(chunk);
+}
+
+
+char *ChainBuffer::prepare(size_t minSize, size_t *room)
+{
+    if (m_slices.empty() || !m_slices.back().chunk || BUFFER_CHUNK_SIZE - m_slices.back().end < minSize)
+    {
+        // the rest of the last chunk is too small, it is left unused
+        m_slices.push_back(Slice{acquireChunk(), nullptr, 0, 0});
+    }
+    Slice &last = m_slices.back();
+    if (room != nullptr)
+    {
+        *room = BUFFER_CHUNK_SIZE - last.end;
+    }
+    return last.chunk->data + last.end;
+}
+
+void ChainBuffer::commit(size_t n)
+{
+    m_slices.back().end += n;
+    m_size += n;
+}
+
+const char *ChainBuffer::front(size_t *len) const
+{
+    if (m_size == 0)
+    {
+        *len = 0;
+        return nullptr;
+    }
+    const Slice &first = m_slices.front();
+    *len = first.end - first.begin;
+    return first.data() + first.begin;
+}
+
+int ChainBuffer::peek(struct iovec *iov, int maxIov, size_t *len) const
+{
+    int count = 0;
+    *len = 0;
+    for (const Slice &slice : m_slices)
+    {
+        if (count >= maxIov)
+        {
+            break;
+        }
+        if (slice.begin == slice.end)
+        {
+            continue;
+        }
+        iov[count].iov_base = slice.data() + slice.begin;
+        iov[count].iov_len = slice.end - slice.begin;
+        *len += iov[count].iov_len;
+        ++count;
+    }
+    return count;
+}
+
+void ChainBuffer::consume(size_t n)
+{
+    n = std::min(n, m_size);
+    m_size -= n;
+    while (n > 0)
+    {
+        Slice &first = m_slices.front();
+        size_t len = std::min(n, first.end - first.begin);
+        first.begin += len;
+        n -= len;
+        if (first.begin == first.end)
+        {
+            m_slices.pop_front();
+        }
+    }
+    if (m_size == 0)
+    {
+        // drained, give the memory back
+        clear();
+    }
+}
+
+void ChainBuffer::append(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t room;
+        char *p = prepare(1, &room);
+        size_t n = std::min(len, room);
+        memcpy(p, data, n);
+        commit(n);
+        data += n;
+        len -= n;
+    }
+}
+
+void ChainBuffer::append(ChunkPtr chunk, size_t len)
+{
+    m_slices.push_back(Slice{std::move(chunk), nullptr, 0, len});
+    m_size += len;
+}
+
+void ChainBuffer::append(const SharedChunk &chunk, const char *data, size_t len)
+{
+    if (len < MIN_SHARED_SLICE_SIZE)
+    {
+        append(data, len);
+        return;
+    }
+    size_t begin = data - chunk->data;
+    m_slices.push_back(Slice{nullptr, chunk, begin, begin + len});
+    m_size += len;
+}
+
+void ChainBuffer::append(ChainBuffer &&other)
+{
+    for (Slice &slice : other.m_slices)
+    {
+        if (slice.begin != slice.end)
+        {
+            m_slices.push_back(std::move(slice));
+        }
+    }
+    m_size += other.m_size;
+    other.clear();
+}
+
+void ChainBuffer::clear()
+{
+    m_slices.clear();
+    m_size = 0;
+}
@@ -0,0 +1,118 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <limits.h>
+#include <sys/uio.h>
+
+const size_t BUFFER_CHUNK_SIZE = 1024 * 64;
+const size_t MAX_FREE_CHUNKS = 256; // chunks kept by the pool of each thread, the others go back to the heap
+const int MAX_WRITE_IOVS = IOV_MAX; // segments handed to one sendmsg, a queue of small records needs many
+
+struct BufferChunk
+{
+    char data[BUFFER_CHUNK_SIZE];
+};
+
+/*
+ * free list of chunks, one per thread, so a reactor never locks for memory.
+ * a chunk may be given back in another thread, it just joins that pool.
+ */
+class ChunkPool
+{
+  private:
+    std::vector<BufferChunk *> m_freeChunks;
+
+  public:
+    ChunkPool() = default;
+    ~ChunkPool();
+    ChunkPool(const ChunkPool &) = delete;
+    ChunkPool &operator=(const ChunkPool &) = delete;
+
+    // the pool of this thread, nullptr once it is destroyed. exit() destroys it before the globals,
+    // which may still free chunks then
+    static ChunkPool *local();
+
+    BufferChunk *acquire();
+    void release(BufferChunk *chunk);
+};
+
+struct ChunkDeleter
+{
+    void operator()(BufferChunk *chunk) const
+    {
+        ChunkPool *pool = ChunkPool::local();
+        if (pool != nullptr)
+        {
+            pool->release(chunk);
+        }
+        else
+        {
+            delete chunk;
+        }
+    }
+};
+using ChunkPtr = std::unique_ptr<BufferChunk, ChunkDeleter>;
+
+inline ChunkPtr acquireChunk()
+{
+    ChunkPool *pool = ChunkPool::local();
+    return ChunkPtr(pool != nullptr ? pool->acquire() : new BufferChunk);
+}
+
+// a chunk read by several buffers, it goes back to the pool with the last of them
+using SharedChunk = std::shared_ptr<BufferChunk>;
+const size_t MIN_SHARED_SLICE_SIZE = BUFFER_CHUNK_SIZE / 4; // smaller parts are copied, they shouldn't hold a whole chunk
+
+
+/*
+ * byte queue made of pooled chunks, memory follows the bytes in it.
+ * writers ask for a contiguous room in the last chunk and commit what they
+ * filled, readers take the front of the first chunk and consume it.
+ */
+class ChainBuffer
+{
+  private:
+    struct Slice
+    {
+        ChunkPtr chunk;     // owned, the last one takes the bytes written
+        SharedChunk shared; // or a part of a chunk read by others too, never written
+        size_t begin;       // bytes in [begin, end) of the chunk
+        size_t end;
+
+        char *data() const { return chunk ? chunk->data : shared->data; }
+    };
+
+    std::deque<Slice> m_slices;
+    size_t m_size{0};
+
+  public:
+    ChainBuffer() = default;
+    ChainBuffer(ChainBuffer &&) = default;
+    ChainBuffer &operator=(ChainBuffer &&) = default;
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // contiguous room of at least minSize bytes (<= BUFFER_CHUNK_SIZE), its size is put in room
+    char *prepare(size_t minSize, size_t *room = nullptr);
+    void commit(size_t n);
+
+    // the contiguous bytes at the front, nullptr if empty
+    const char *front(size_t *len) const;
+    // the first slices as at most maxIov segments for sendmsg, returns the count and puts their size in len
+    int peek(struct iovec *iov, int maxIov, size_t *len) const;
+    void consume(size_t n);
+
+    void append(const char *data, size_t len);
+    void append(ChunkPtr chunk, size_t len); // take a filled chunk as it is, no copy
+    void append(const SharedChunk &chunk, const char *data, size_t len); // data is in the chunk, kept by reference
+    void append(ChainBuffer &&other); // take all the slices of other, it is left empty
+    void clear();
+};
+
+#endif // __BUFFER_H__
@@ -1,99 +1,137 @@
+#include <algorithm>
+#include <sys/timerfd.h>
+
 #include "epoll_demultiplexer.h"
 
-EpollDemultiplexer::EpollDemultiplexer()
+EpollDemultiplexer::EpollDemultiplexer() : m_fdTimer(-1), m_isEdgeTriggered(false)
 {
     m_fdEpoll = epoll_create(1024);
 }
 
 EpollDemultiplexer::~EpollDemultiplexer()
 {
+    if (m_fdTimer != -1)
+    {
+        close(m_fdTimer);
+    }
     close(m_fdEpoll);
 }
 
-void EpollDemultiplexer::addEvent(const EventHandlerMap &fileEvents,
-                                  int fd, int mask)
+void EpollDemultiplexer::enableHighResTimer()
 {
-    auto it = fileEvents.find(fd);
-    int op = EPOLL_CTL_MOD;
-    if (it == fileEvents.end())
+    if (m_fdTimer != -1)
     {
-        op = EPOLL_CTL_ADD;
+        return;
     }
-    else
+    m_fdTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_fdTimer == -1)
     {
-        mask |= it->second.mask;
+        return;
     }
-    
+
     struct epoll_event ee = {0};
-    ee.events = 0;
-    
-    if (mask & EVENT_READABLE)
-    {
-        ee.events |= EPOLLIN;
-    }
-    if (mask & EVENT_WRITABLE)
-    {
-        ee.events |= EPOLLOUT;
-    }
-    ee.data.fd = fd;
-    //printf("----------fd:%d, op:%d, mask:%d\n",fd,op,mask);
-    epoll_ctl(m_fdEpoll, op, fd, &ee);
+    ee.events = EPOLLIN;
+    ee.data.fd = m_fdTimer;
+    epoll_ctl(m_fdEpoll, EPOLL_CTL_ADD, m_fdTimer, &ee);
+}
+
+bool EpollDemultiplexer::enableEdgeTriggered()
+{
+    m_isEdgeTriggered = true;
+    return true;
 }
 
-void EpollDemultiplexer::delEvent(const EventHandlerMap &fileEvents,
-                                  int fd, int mask)
+void EpollDemultiplexer::modEvent(int fd, int oldMask, int newMask)
 {
-    auto it = fileEvents.find(fd);
-    if (it == fileEvents.end())
+    int op = EPOLL_CTL_MOD;
+    if (oldMask == EVENT_NONE)
     {
-        return;
+        op = EPOLL_CTL_ADD;
+    }
+    else if (newMask == EVENT_NONE)
+    {
+        op = EPOLL_CTL_DEL;
     }
+
     struct epoll_event ee = {0};
     ee.events = 0;
-    int nowMask = it->second.mask & (~mask);
-    if (nowMask & EVENT_READABLE)
+
+    if (newMask & EVENT_READABLE)
     {
         ee.events |= EPOLLIN;
     }
-    if (nowMask & EVENT_WRITABLE)
+    if (newMask & EVENT_WRITABLE)
     {
         ee.events |= EPOLLOUT;
     }
+    if (m_isEdgeTriggered)
+    {
+        ee.events |= EPOLLET;
+    }
     ee.data.fd = fd;
-    int op = nowMask == EVENT_NONE ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    //printf("----------fd:%d, op:%d, mask:%d\n",fd,op,newMask);
     epoll_ctl(m_fdEpoll, op, fd, &ee);
 }
 
-int EpollDemultiplexer::pollEvent(const EventHandlerMap &fileEvents,
+int EpollDemultiplexer::pollEvent(const EventHandlerTable &fileEvents,
                                   FiredEvents &firedEvents, timeval *tvp)
 {
-    if (m_epollEvents.capacity() < fileEvents.size())
+    size_t maxEvents = std::max(fileEvents.maxFd() + 1, 1);
+    if (m_epollEvents.size() < maxEvents)
     {
-        m_epollEvents.resize(fileEvents.size());
+        m_epollEvents.resize(maxEvents);
     }
-    int ret = epoll_wait(m_fdEpoll, &m_epollEvents[0], m_epollEvents.size(),
-                         tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) : -1);
+    int timeout = -1;
+    if (tvp)
+    {
+        long long us = tvp->tv_sec * 1000000LL + tvp->tv_usec;
+        if (m_fdTimer != -1 && us % 1000 != 0)
+        {
+            // the timerfd wakes epoll_wait up at the exact time
+            struct itimerspec its{};
+            its.it_value.tv_sec = tvp->tv_sec;
+            its.it_value.tv_nsec = tvp->tv_usec * 1000;
+            timerfd_settime(m_fdTimer, 0, &its, nullptr);
+        }
+        else
+        {
+            // round up, waking up early only makes the loop spin until the timer is due
+            timeout = (us + 999) / 1000;
+        }
+    }
+
+    int ret = epoll_wait(m_fdEpoll, &m_epollEvents[0], m_epollEvents.size(), timeout);
     if (ret <= 0)
     {
         return 0;
     }
-    if(firedEvents.capacity() < static_cast<size_t>(ret))
+    if(firedEvents.size() < static_cast<size_t>(ret))
     {
         firedEvents.resize(ret);
     }
+    int num = 0;
     for (int i = 0; i < ret; i++)
     {
+        if (m_epollEvents[i].data.fd == m_fdTimer)
+        {
+            uint64_t expirations;
+            read(m_fdTimer, &expirations, sizeof(expirations));
+            continue;
+        }
+
         int mask = 0;
-        if (m_epollEvents[i].events & EPOLLIN)
+        // errors and hangups are reported to both procs, the next recv or send sees them
+        if (m_epollEvents[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
         {
             mask |= EVENT_READABLE;
         }
-        if (m_epollEvents[i].events & EPOLLOUT)
+        if (m_epollEvents[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
         {
             mask |= EVENT_WRITABLE;
         }
-        firedEvents[i].fd = m_epollEvents[i].data.fd;
-        firedEvents[i].mask = mask;
+        firedEvents[num].fd = m_epollEvents[i].data.fd;
+        firedEvents[num].mask = mask;
+        num++;
     }
-    return ret;
+    return num;
 }
@@ -13,13 +13,16 @@ class EpollDemultiplexer : public EventDemultiplexer
     EpollDemultiplexer();
     virtual ~EpollDemultiplexer();
 
-    void addEvent(const EventHandlerMap& fileEvents, int fd, int mask) override;
-    void delEvent(const EventHandlerMap& fileEvents, int fd, int mask) override;
-    int pollEvent(const EventHandlerMap &fileEvents,
+    void modEvent(int fd, int oldMask, int newMask) override;
+    int pollEvent(const EventHandlerTable &fileEvents,
                           FiredEvents &firedEvents, timeval *tvp) override;
+    void enableHighResTimer() override;
+    bool enableEdgeTriggered() override;
 
   private:
     int m_fdEpoll;
+    int m_fdTimer; // timerfd for the timeouts epoll_wait can't express in milliseconds
+    bool m_isEdgeTriggered;
     std::vector<struct epoll_event> m_epollEvents;
 };
 
@@ -7,7 +7,7 @@
 #define EVENT_BARRIER 4
 
 #include <vector>
-#include <map>
+#include <algorithm>
 #include <functional>
 
 struct FiredEvent
@@ -22,11 +22,94 @@ using FileProc = std::function<void(int fd, int mask)>;
 
 struct FileEvent
 {
-    int mask;
+    int mask;       // events the procs want
+    int kernelMask; // events registered in the demultiplexer, synced before polling
+    bool isDirty;   // mask != kernelMask maybe, fd is in the dirty list of reactor
+    int activeMask; // events to fire without the demultiplexer, fd is in the active list of reactor
     FileProc wFileProc;
     FileProc rFileProc;
-    FileEvent(int _mask = 0): mask(_mask){}
+    FileEvent(int _mask = 0): mask(_mask), kernelMask(EVENT_NONE), isDirty(false), activeMask(EVENT_NONE){}
+};
+
+const size_t DEFAULT_EVENT_TABLE_SIZE = 1024;
+
+/*
+ * file events index by fd, like the events array of redis aeEventLoop.
+ * fds are small and dense, so a lookup is just an array access.
+ */
+class EventHandlerTable
+{
+  private:
+    std::vector<FileEvent> m_events;
+    int m_maxFd{-1}; // the highest fd with events, -1 if none
+
+  public:
+    EventHandlerTable() : m_events(DEFAULT_EVENT_TABLE_SIZE) {}
+
+    // nullptr if there is no event of this fd
+    FileEvent *find(int fd)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= m_events.size() || m_events[fd].mask == EVENT_NONE)
+        {
+            return nullptr;
+        }
+        return &m_events[fd];
+    }
+
+    const FileEvent *find(int fd) const
+    {
+        return const_cast<EventHandlerTable *>(this)->find(fd);
+    }
+
+    // the slot of fd even if it has no event, nullptr if the table is too small
+    FileEvent *slot(int fd)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= m_events.size())
+        {
+            return nullptr;
+        }
+        return &m_events[fd];
+    }
+
+    // get the slot of fd to register events, the table grows if needed. nullptr if fd is negative
+    FileEvent *get(int fd)
+    {
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        if (static_cast<size_t>(fd) >= m_events.size())
+        {
+            m_events.resize(std::max(static_cast<size_t>(fd) + 1, m_events.size() * 2));
+        }
+        if (fd > m_maxFd)
+        {
+            m_maxFd = fd;
+        }
+        return &m_events[fd];
+    }
+
+    // procs are kept, they may be running now and will be replaced by next register
+    void erase(int fd)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= m_events.size())
+        {
+            return;
+        }
+        m_events[fd].mask = EVENT_NONE;
+        if (fd == m_maxFd)
+        {
+            while (m_maxFd >= 0 && m_events[m_maxFd].mask == EVENT_NONE)
+            {
+                m_maxFd--;
+            }
+        }
+    }
+
+    int maxFd() const
+    {
+        return m_maxFd;
+    }
 };
-using EventHandlerMap = std::map<int, FileEvent>;
 
 #endif // __EVENT_H__
\ No newline at end of file
@@ -1,19 +1,49 @@
 #ifndef __EVENT_DEMULTIPLEXER_H__
 #define __EVENT_DEMULTIPLEXER_H__
 
+#include <cstdint>
 #include <ctime>
+#include <vector>
+
+#include <sys/socket.h>
+
 #include "event.h"
 
 
+struct IoCompletion
+{
+    uint64_t id; // given at submit
+    int res;     // bytes done or -errno
+};
+using IoCompletions = std::vector<IoCompletion>;
+
+
 class EventDemultiplexer
 {
   public:
     EventDemultiplexer() = default;
     virtual ~EventDemultiplexer() = default;
 
-    virtual void addEvent(const EventHandlerMap &fileEvents, int fd, int mask) = 0;
-    virtual void delEvent(const EventHandlerMap &fileEvents, int fd, int mask) = 0;
-    virtual int pollEvent(const EventHandlerMap &fileEvents, FiredEvents &fired_events, timeval *tvp) = 0;
+    // change the events of fd in kernel from oldMask to newMask, EVENT_NONE means not registered
+    virtual void modEvent(int fd, int oldMask, int newMask) = 0;
+    virtual int pollEvent(const EventHandlerTable &fileEvents, FiredEvents &fired_events, timeval *tvp) = 0;
+
+    // make pollEvent wait with microsecond precision, most backends already do
+    virtual void enableHighResTimer() {}
+
+    // register the events edge triggered from now on, false if the backend can't
+    virtual bool enableEdgeTriggered() { return false; }
+
+    // completion style io, the kernel sends by itself and pollEvent wakes up when it is done.
+    // the backends without it only tell readiness
+    virtual bool canSubmitIo() const { return false; }
+    // msg and the memory it points to must be kept until the completion of id is taken
+    virtual bool submitSendmsg(int fd, const msghdr *msg, uint64_t id) { return false; }
+    // the completion of id still comes, -ECANCELED if it was stopped in time. the io is submitted
+    // before this returns, so fd may be closed right after it
+    virtual void cancelIo(uint64_t id) {}
+    // move the completions got by the last pollEvent to completions
+    virtual void takeCompletions(IoCompletions &completions) {}
 };
 
 #endif // __EVENT_DEMULTIPLEXER_H__
\ No newline at end of file
@@ -0,0 +1,446 @@
+#include "io_uring_demultiplexer.h"
+
+#ifdef HAVE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// user data of poll removes and cancels, the completion carries nothing for us
+const __u64 IGNORED_USER_DATA = ~0ULL;
+// the top bit marks the io requests, the rest is the id given by the reactor
+const __u64 IO_USER_DATA_FLAG = 1ULL << 63;
+const unsigned int POLL_GEN_MASK = 0x7fffffff;
+const unsigned int DEFAULT_RING_ENTRIES = 4096;
+
+
+static inline __u64 makeUserData(int fd, unsigned int gen)
+{
+    return (static_cast<__u64>(gen & POLL_GEN_MASK) << 32) | static_cast<unsigned int>(fd);
+}
+
+IoUringDemultiplexer::IoUringDemultiplexer()
+    : m_ringFd(-1), m_sqEntries(0), m_hasFastPoll(false), m_sqRing(MAP_FAILED), m_sqRingSize(0),
+      m_cqRing(MAP_FAILED), m_cqRingSize(0), m_sqes(nullptr), m_sqesSize(0),
+      m_toSubmit(0)
+{
+    if (!setupRing(DEFAULT_RING_ENTRIES))
+    {
+        closeRing();
+    }
+}
+
+IoUringDemultiplexer::~IoUringDemultiplexer()
+{
+    closeRing();
+}
+
+bool IoUringDemultiplexer::setupRing(unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    m_ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (m_ringFd < 0)
+    {
+        m_ringFd = -1;
+        return false;
+    }
+
+    // need timeout in io_uring_enter and never lose completions
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        return false;
+    }
+
+    m_hasFastPoll = params.features & IORING_FEAT_FAST_POLL;
+    m_sqEntries = params.sq_entries;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+    {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED)
+    {
+        return false;
+    }
+    if (singleMmap)
+    {
+        m_cqRing = m_sqRing;
+    }
+    else
+    {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED)
+        {
+            return false;
+        }
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return false;
+    }
+    m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(m_sqRing);
+    char *cq = static_cast<char *>(m_cqRing);
+    m_sqHead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    m_cqHead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void IoUringDemultiplexer::closeRing()
+{
+    m_hasFastPoll = false;
+    if (m_sqes != nullptr)
+    {
+        munmap(m_sqes, m_sqesSize);
+        m_sqes = nullptr;
+    }
+    if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+    {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    m_cqRing = MAP_FAILED;
+    if (m_sqRing != MAP_FAILED)
+    {
+        munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = MAP_FAILED;
+    }
+    if (m_ringFd != -1)
+    {
+        close(m_ringFd);
+        m_ringFd = -1;
+    }
+}
+
+IoUringDemultiplexer::PollState &IoUringDemultiplexer::state(int fd)
+{
+    if (m_states.size() <= static_cast<size_t>(fd))
+    {
+        m_states.resize(fd + 1);
+    }
+    return m_states[fd];
+}
+
+void IoUringDemultiplexer::markDirty(int fd)
+{
+    PollState &st = state(fd);
+    if (!st.dirty)
+    {
+        st.dirty = true;
+        m_dirtyFds.push_back(fd);
+    }
+}
+
+struct io_uring_sqe *IoUringDemultiplexer::getSqe()
+{
+    unsigned int head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    unsigned int tail = *m_sqTail;
+    if (tail - head >= m_sqEntries)
+    {
+        // sq is full, submit what we have without waiting
+        int ret = enter(m_toSubmit, 0, 0, nullptr);
+        if (ret > 0)
+        {
+            m_toSubmit -= std::min(m_toSubmit, static_cast<unsigned int>(ret));
+        }
+        head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (tail - head >= m_sqEntries)
+        {
+            return nullptr;
+        }
+    }
+
+    unsigned int idx = tail & *m_sqMask;
+    struct io_uring_sqe *sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[idx] = idx;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    m_toSubmit++;
+    return sqe;
+}
+
+int IoUringDemultiplexer::enter(unsigned int toSubmit, unsigned int minComplete,
+                                unsigned int flags, timeval *tvp)
+{
+    struct __kernel_timespec ts = {0, 0};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (tvp)
+    {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = reinterpret_cast<__u64>(&ts);
+    }
+    return syscall(__NR_io_uring_enter, m_ringFd, toSubmit, minComplete,
+                   flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+void IoUringDemultiplexer::modEvent(int fd, int oldMask, int newMask)
+{
+    PollState &st = state(fd);
+    st.mask = newMask;
+    if (st.mask == EVENT_NONE && st.armed)
+    {
+        // the fd may be closed and reused before the next flush, forget the
+        // old poll request right now so a new one is armed for the new file.
+        // the request holds the file, a remove the sq has no room for is kept
+        if (!queuePollRemove(makeUserData(fd, st.gen)))
+        {
+            m_pendingRemoves.push_back(makeUserData(fd, st.gen));
+        }
+        st.gen++;
+        st.armed = false;
+    }
+    markDirty(fd);
+}
+
+bool IoUringDemultiplexer::queuePollRemove(__u64 pollUserData)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == nullptr)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = pollUserData;
+    sqe->user_data = IGNORED_USER_DATA;
+    return true;
+}
+
+void IoUringDemultiplexer::flushDirty()
+{
+    while (!m_pendingRemoves.empty() && queuePollRemove(m_pendingRemoves.back()))
+    {
+        m_pendingRemoves.pop_back();
+    }
+    size_t sent = 0;
+    while (sent < m_pendingSends.size() && queueSendmsg(m_pendingSends[sent]))
+    {
+        sent++;
+    }
+    m_pendingSends.erase(m_pendingSends.begin(), m_pendingSends.begin() + sent);
+
+    // an fd stays dirty until its sqes are queued, if the sq is full it is tried again next loop
+    size_t kept = 0;
+    for (int fd : m_dirtyFds)
+    {
+        PollState &st = m_states[fd];
+        if (syncPoll(fd, st))
+        {
+            st.dirty = false;
+        }
+        else
+        {
+            m_dirtyFds[kept++] = fd;
+        }
+    }
+    m_dirtyFds.resize(kept);
+}
+
+// queue the sqes that make the poll request of fd match its mask, false if the sq is full
+bool IoUringDemultiplexer::syncPoll(int fd, PollState &st)
+{
+    if (st.armed && st.armedMask != st.mask)
+    {
+        if (!queuePollRemove(makeUserData(fd, st.gen)))
+        {
+            return false;
+        }
+        st.gen++;
+        st.armed = false;
+    }
+
+    if (!st.armed && st.mask != EVENT_NONE)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            return false;
+        }
+        __u32 events = 0;
+        if (st.mask & EVENT_READABLE)
+        {
+            events |= POLLIN;
+        }
+        if (st.mask & EVENT_WRITABLE)
+        {
+            events |= POLLOUT;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = makeUserData(fd, st.gen);
+        st.armed = true;
+        st.armedMask = st.mask;
+    }
+    return true;
+}
+
+bool IoUringDemultiplexer::queueSendmsg(const SendmsgRequest &req)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == nullptr)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = req.fd;
+    sqe->addr = reinterpret_cast<__u64>(req.msg);
+    sqe->len = 1;
+    sqe->user_data = IO_USER_DATA_FLAG | req.id;
+    return true;
+}
+
+// sent with the next io_uring_enter, a full sq keeps it for the flush of next loop
+bool IoUringDemultiplexer::submitSendmsg(int fd, const msghdr *msg, uint64_t id)
+{
+    SendmsgRequest req = {fd, msg, id};
+    if (!queueSendmsg(req))
+    {
+        m_pendingSends.push_back(req);
+    }
+    return true;
+}
+
+void IoUringDemultiplexer::cancelIo(uint64_t id)
+{
+    for (auto it = m_pendingSends.begin(); it != m_pendingSends.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            // never reached the kernel
+            m_pendingSends.erase(it);
+            m_completions.push_back(IoCompletion{id, -ECANCELED});
+            return;
+        }
+    }
+
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe != nullptr)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = IO_USER_DATA_FLAG | id;
+        sqe->user_data = IGNORED_USER_DATA;
+    }
+    // the kernel looks the fd up when it takes the sqe, that must happen before the caller
+    // closes it, or a new file with the same fd gets the data. without room for the cancel
+    // the request just runs to its end on the old file
+    int ret = enter(m_toSubmit, 0, 0, nullptr);
+    if (ret > 0)
+    {
+        m_toSubmit -= std::min(m_toSubmit, static_cast<unsigned int>(ret));
+    }
+}
+
+void IoUringDemultiplexer::takeCompletions(IoCompletions &completions)
+{
+    completions.swap(m_completions);
+    m_completions.clear();
+}
+
+int IoUringDemultiplexer::pollEvent(const EventHandlerTable &fileEvents,
+                                    FiredEvents &firedEvents, timeval *tvp)
+{
+    flushDirty();
+    struct timeval zero = {0, 0};
+    if (!m_dirtyFds.empty() || !m_pendingRemoves.empty() || !m_pendingSends.empty() || !m_completions.empty())
+    {
+        // some requests are not queued yet or some completions wait for the reactor, don't sleep
+        tvp = &zero;
+    }
+
+    int ret = enter(m_toSubmit, 1, IORING_ENTER_GETEVENTS, tvp);
+    if (ret > 0)
+    {
+        m_toSubmit -= std::min(m_toSubmit, static_cast<unsigned int>(ret));
+    }
+
+    unsigned int head = *m_cqHead;
+    unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    int num = 0;
+    for (; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+        __u64 userData = cqe->user_data;
+        int res = cqe->res;
+        if (userData == IGNORED_USER_DATA)
+        {
+            continue;
+        }
+        if (userData & IO_USER_DATA_FLAG)
+        {
+            m_completions.push_back(IoCompletion{userData & ~IO_USER_DATA_FLAG, res});
+            continue;
+        }
+
+        int fd = static_cast<int>(userData & 0xffffffff);
+        unsigned int gen = static_cast<unsigned int>(userData >> 32);
+        if (m_states.size() <= static_cast<size_t>(fd) || (m_states[fd].gen & POLL_GEN_MASK) != gen)
+        {
+            continue;
+        }
+
+        // one shot poll is consumed, arm it again at next flush,
+        // so it behaves like level triggered epoll
+        PollState &st = m_states[fd];
+        st.armed = false;
+        markDirty(fd);
+        if (res < 0)
+        {
+            continue;
+        }
+
+        int mask = 0;
+        if (res & (POLLIN | POLLHUP | POLLERR))
+        {
+            mask |= EVENT_READABLE;
+        }
+        if (res & (POLLOUT | POLLHUP | POLLERR))
+        {
+            mask |= EVENT_WRITABLE;
+        }
+        mask &= st.mask;
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        if (firedEvents.size() <= static_cast<size_t>(num))
+        {
+            firedEvents.resize(num + 1);
+        }
+        firedEvents[num].fd = fd;
+        firedEvents[num].mask = mask;
+        num++;
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+    return num;
+}
+
+#endif // HAVE_IO_URING
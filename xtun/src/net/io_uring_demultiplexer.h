@@ -0,0 +1,105 @@
+#ifndef __IO_URING_DEMULTIPLEXER_H__
+#define __IO_URING_DEMULTIPLEXER_H__
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// need kernel headers of linux 5.11+ for the timeout of io_uring_enter
+#ifdef IORING_FEAT_EXT_ARG
+#define HAVE_IO_URING 1
+
+#include <vector>
+
+#include "event_demultiplexer.h"
+
+
+/*
+ * readiness demultiplexer on top of io_uring one shot poll requests.
+ * interest changes and poll re-arms are only queued as sqes, they are
+ * submitted together with the wait in one io_uring_enter per loop.
+ * sendmsg requests go in the same batch, their completions are kept
+ * for the reactor, see takeCompletions.
+ */
+class IoUringDemultiplexer : public EventDemultiplexer
+{
+  public:
+    IoUringDemultiplexer();
+    virtual ~IoUringDemultiplexer();
+
+    // false if the kernel has no usable io_uring, use another demultiplexer then
+    bool isReady() const { return m_ringFd != -1; }
+
+    void modEvent(int fd, int oldMask, int newMask) override;
+    int pollEvent(const EventHandlerTable &fileEvents,
+                          FiredEvents &firedEvents, timeval *tvp) override;
+
+    bool canSubmitIo() const override { return m_hasFastPoll; }
+    bool submitSendmsg(int fd, const msghdr *msg, uint64_t id) override;
+    void cancelIo(uint64_t id) override;
+    void takeCompletions(IoCompletions &completions) override;
+
+  private:
+    struct PollState
+    {
+        int mask{EVENT_NONE};       // wanted events
+        int armedMask{EVENT_NONE};  // events of the poll request in kernel
+        unsigned int gen{0};        // completions of older generations are stale
+        bool armed{false};
+        bool dirty{false};
+    };
+
+    struct SendmsgRequest
+    {
+        int fd;
+        const msghdr *msg;
+        uint64_t id;
+    };
+
+    int m_ringFd;
+    unsigned int m_sqEntries;
+    bool m_hasFastPoll; // a send to a full socket mostly waits in kernel, the reactor polls on EAGAIN
+
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+
+    unsigned int *m_sqHead;
+    unsigned int *m_sqTail;
+    unsigned int *m_sqMask;
+    unsigned int *m_sqArray;
+    unsigned int *m_cqHead;
+    unsigned int *m_cqTail;
+    unsigned int *m_cqMask;
+    struct io_uring_cqe *m_cqes;
+
+    unsigned int m_toSubmit;
+
+    std::vector<PollState> m_states; // index by fd
+    std::vector<int> m_dirtyFds;
+    std::vector<__u64> m_pendingRemoves; // poll removes the sq had no room for
+    std::vector<SendmsgRequest> m_pendingSends; // sendmsgs the sq had no room for
+    IoCompletions m_completions;
+
+    bool setupRing(unsigned int entries);
+    void closeRing();
+
+    PollState &state(int fd);
+    void markDirty(int fd);
+    void flushDirty();
+    bool queuePollRemove(__u64 pollUserData);
+    bool syncPoll(int fd, PollState &st);
+    bool queueSendmsg(const SendmsgRequest &req);
+
+    struct io_uring_sqe *getSqe();
+    int enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags, timeval *tvp);
+};
+
+#endif // IORING_FEAT_EXT_ARG
+
+#endif // __IO_URING_DEMULTIPLEXER_H__
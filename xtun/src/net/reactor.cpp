@@ -1,62 +1,238 @@
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <utility>
+#include <unistd.h>
 
 #include "reactor.h"
+#include "tnet.h"
 
 
-Reactor::Reactor() : m_demultiplexer(nullptr), m_isStopLoop(false)
-{
 #ifdef __linux__
-    m_demultiplexer = std::make_unique<EpollDemultiplexer>();
+IO_BACKEND Reactor::s_ioBackend = IO_BACKEND_EPOLL;
 #else
-    m_demultiplexer = std::make_unique<SelectDemultiplexer>();
+IO_BACKEND Reactor::s_ioBackend = IO_BACKEND_SELECT;
 #endif // __linux__
+bool Reactor::s_isEdgeTriggered = false;
+
+void Reactor::setIoBackend(IO_BACKEND backend)
+{
+    s_ioBackend = backend;
+}
+
+void Reactor::setEdgeTriggered(bool isEdgeTriggered)
+{
+    s_isEdgeTriggered = isEdgeTriggered;
 }
 
-void Reactor::registerFileEvent(int fd, int mask, const FileProc& proc)
+Reactor::Reactor() : m_demultiplexer(nullptr), m_isStopLoop(false), m_isEdgeTriggered(false)
 {
-    m_demultiplexer->addEvent(m_fileEvents, fd, mask);
-    auto it = m_fileEvents.find(fd);
-    if (it == m_fileEvents.end())
+#ifdef HAVE_IO_URING
+    if (s_ioBackend == IO_BACKEND_IO_URING)
     {
-        FileEvent fe;
-        fe.mask = mask;
-        if (mask & EVENT_READABLE)
+        auto uring = std::make_unique<IoUringDemultiplexer>();
+        if (uring->isReady())
         {
-            fe.rFileProc = proc;
+            m_demultiplexer = std::move(uring);
         }
-        if (mask & EVENT_WRITABLE)
+        else
         {
-            fe.wFileProc = proc;
+            printf("io_uring is not available, use epoll\n");
         }
-        m_fileEvents[fd] = fe;
     }
-    else
+#endif // HAVE_IO_URING
+
+    if (m_demultiplexer == nullptr)
     {
-        it->second.mask |= mask;
-        if (mask & EVENT_READABLE)
+#ifdef __linux__
+        if (s_ioBackend != IO_BACKEND_SELECT)
         {
-            it->second.rFileProc = proc;
+            m_demultiplexer = std::make_unique<EpollDemultiplexer>();
         }
-        if (mask & EVENT_WRITABLE)
+#endif // __linux__
+    }
+    if (m_demultiplexer == nullptr)
+    {
+        m_demultiplexer = std::make_unique<SelectDemultiplexer>();
+    }
+    if (s_isEdgeTriggered)
+    {
+        m_isEdgeTriggered = m_demultiplexer->enableEdgeTriggered();
+        if (!m_isEdgeTriggered)
         {
-            it->second.wFileProc = proc;
+            printf("the io backend has no edge triggered mode, use level triggered\n");
         }
     }
+
+    if (pipe(m_wakeupFds) == -1)
+    {
+        printf("reactor make wakeup pipe err: %d\n", errno);
+        m_wakeupFds[0] = m_wakeupFds[1] = -1;
+        return;
+    }
+    tnet::non_block(m_wakeupFds[0]);
+    tnet::non_block(m_wakeupFds[1]);
+    registerFileEvent(
+        m_wakeupFds[0],
+        EVENT_READABLE,
+        std::bind(
+            &Reactor::wakeupReadProc,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
+}
+
+Reactor::~Reactor()
+{
+    if (m_wakeupFds[0] != -1)
+    {
+        removeFileEvent(m_wakeupFds[0], EVENT_READABLE);
+        close(m_wakeupFds[0]);
+        close(m_wakeupFds[1]);
+    }
+}
+
+/*
+ * the kernel side is not touched here, changed fds are put in the dirty list
+ * and synced once before polling. so removing and registering the same event
+ * in one loop costs no syscall, neither does registering an event twice.
+ *
+ * in edge triggered mode the fd is registered for both events once, and
+ * the edge of a newly wanted event may be gone already, so it is fired in
+ * next loop by the reactor itself.
+ */
+bool Reactor::registerFileEvent(int fd, int mask, const FileProc& proc)
+{
+    FileEvent *slot = m_fileEvents.get(fd);
+    if (slot == nullptr)
+    {
+        // a failed socket() or accept() passed in
+        return false;
+    }
+    FileEvent &fe = *slot;
+    int newMask = mask & (~fe.mask);
+    fe.mask |= mask;
+    if (mask & EVENT_READABLE)
+    {
+        fe.rFileProc = proc;
+    }
+    if (mask & EVENT_WRITABLE)
+    {
+        fe.wFileProc = proc;
+    }
+    markDirty(fd, fe);
+    if (m_isEdgeTriggered && fe.kernelMask != EVENT_NONE && newMask != EVENT_NONE)
+    {
+        activateFileEvent(fd, newMask);
+    }
+    return true;
 }
 
 void Reactor::removeFileEvent(int fd, int mask)
 {
-    m_demultiplexer->delEvent(m_fileEvents, fd, mask);
-    auto it = m_fileEvents.find(fd);
-    if (it == m_fileEvents.end())
+    FileEvent *fe = m_fileEvents.find(fd);
+    if (fe == nullptr)
+    {
+        return;
+    }
+    fe->mask = fe->mask & (~mask);
+    if (fe->mask == EVENT_NONE)
+    {
+        // the fd is going to be closed and may be reused soon, sync right now
+        if (fe->kernelMask != EVENT_NONE)
+        {
+            m_demultiplexer->modEvent(fd, fe->kernelMask, EVENT_NONE);
+            fe->kernelMask = EVENT_NONE;
+        }
+        fe->activeMask = EVENT_NONE;
+        m_fileEvents.erase(fd);
+        return;
+    }
+    markDirty(fd, *fe);
+}
+
+void Reactor::setFileProc(int fd, int mask, const FileProc& proc)
+{
+    FileEvent *fe = m_fileEvents.find(fd);
+    if (fe == nullptr)
+    {
+        return;
+    }
+    if (mask & fe->mask & EVENT_READABLE)
+    {
+        fe->rFileProc = proc;
+    }
+    if (mask & fe->mask & EVENT_WRITABLE)
+    {
+        fe->wFileProc = proc;
+    }
+}
+
+void Reactor::activateFileEvent(int fd, int mask)
+{
+    FileEvent *fe = m_fileEvents.find(fd);
+    if (fe == nullptr)
     {
         return;
     }
-    it->second.mask = it->second.mask & (~mask);
-    if (it->second.mask == 0)
+    if (fe->activeMask == EVENT_NONE)
     {
-        m_fileEvents.erase(it);
+        m_activeFds.push_back(fd);
+    }
+    fe->activeMask |= mask;
+}
+
+int Reactor::kernelMaskOf(int mask) const
+{
+    if (m_isEdgeTriggered && mask != EVENT_NONE)
+    {
+        return EVENT_READABLE | EVENT_WRITABLE;
+    }
+    return mask;
+}
+
+void Reactor::markDirty(int fd, FileEvent &fe)
+{
+    if (!fe.isDirty && kernelMaskOf(fe.mask) != fe.kernelMask)
+    {
+        fe.isDirty = true;
+        m_dirtyFds.push_back(fd);
+    }
+}
+
+void Reactor::syncDirtyEvents()
+{
+    for (int fd : m_dirtyFds)
+    {
+        FileEvent *fe = m_fileEvents.slot(fd);
+        fe->isDirty = false;
+        int kernelMask = kernelMaskOf(fe->mask);
+        if (kernelMask != fe->kernelMask)
+        {
+            m_demultiplexer->modEvent(fd, fe->kernelMask, kernelMask);
+            fe->kernelMask = kernelMask;
+        }
+    }
+    m_dirtyFds.clear();
+}
+
+void Reactor::dispatchFileEvent(int fd, int mask, int &processed)
+{
+    // look up again after each proc, it may remove the event or grow the table
+    // the kernel may still report events the procs removed in this loop
+    FileEvent *fe = m_fileEvents.find(fd);
+    if (fe != nullptr && fe->mask & mask & EVENT_READABLE)
+    {
+        fe->rFileProc(fd, mask);
+        processed++;
+    }
+    fe = m_fileEvents.find(fd);
+    if (fe != nullptr && fe->mask & mask & EVENT_WRITABLE)
+    {
+        fe->wFileProc(fd, mask);
+        processed++;
     }
 }
 
@@ -67,25 +243,29 @@ int Reactor::processEvents(int flag)
 
     int ret, processed = 0;
     struct timeval tv{}, *tvp;
-    TimeEvent teShortest;
-    teShortest.id = -1;
+    const TimeEvent *teShortest = nullptr;
+    updateLoopTime();
     if ((flag & EVENT_LOOP_TIMER_EVENT) && !(flag & EVENT_LOOP_DONT_WAIT))
     {
         teShortest = m_timer.getNearestTimer();
     }
 
-    if (teShortest.id != -1)
+    if (!m_activeFds.empty())
+    {
+        // there are events to fire, just poll what is ready now
+        tvp = &tv;
+        tvp->tv_sec = 0;
+        tvp->tv_usec = 0;
+    }
+    else if (teShortest != nullptr)
     {
-        long now_sec, now_ms;
-        getTime(&now_sec, &now_ms);
         tvp = &tv;
-        long long ms = (teShortest.when_sec - now_sec) * 1000 +
-                       teShortest.when_ms - now_ms;
-        if (ms > 0)
+        long long us = teShortest->whenUs - getLoopTimeUs();
+        if (us > 0)
         {
             // 等待最近的定时器触发的时间
-            tvp->tv_sec = ms / 1000;
-            tvp->tv_usec = (ms % 1000) * 1000;
+            tvp->tv_sec = us / 1000000;
+            tvp->tv_usec = us % 1000000;
         }
         else
         {
@@ -117,31 +297,60 @@ int Reactor::processEvents(int flag)
     }
 
     // printf("poll event!\n");
+    syncDirtyEvents();
     ret = m_demultiplexer->pollEvent(m_fileEvents, m_firedEvents, tvp);
+    updateLoopTime(); // all the procs of this loop use this time
+    processCompletions();
 
     // printf("poll event done! %d\n", ret);
 
+    // the procs activate events for next loop, not the ones being fired now
+    std::vector<int> activeFds;
+    activeFds.swap(m_activeFds);
+
     for (int i = 0; i < ret; i++)
     {
         int fd = m_firedEvents[i].fd;
         int mask = m_firedEvents[i].mask;
 
-        if (m_fileEvents.find(fd) != m_fileEvents.end() && mask & EVENT_READABLE)
+        // fire the active events of fd together with the polled ones
+        FileEvent *fe = m_fileEvents.find(fd);
+        if (fe != nullptr)
         {
-            m_fileEvents[fd].rFileProc(fd, mask);
-            processed++;
+            mask |= fe->activeMask;
+            fe->activeMask = EVENT_NONE;
         }
-        if (m_fileEvents.find(fd) != m_fileEvents.end() && mask & EVENT_WRITABLE)
+        dispatchFileEvent(fd, mask, processed);
+    }
+
+    for (int fd : activeFds)
+    {
+        FileEvent *fe = m_fileEvents.find(fd);
+        if (fe == nullptr || fe->activeMask == EVENT_NONE)
         {
-            m_fileEvents[fd].wFileProc(fd, mask);
-            processed++;
+            continue;
         }
+        int mask = fe->activeMask;
+        fe->activeMask = EVENT_NONE;
+        dispatchFileEvent(fd, mask, processed);
+    }
+    // put back the list if nobody activated more, saves the allocation
+    if (m_activeFds.empty())
+    {
+        activeFds.clear();
+        m_activeFds.swap(activeFds);
     }
 
     if (flag & EVENT_LOOP_TIMER_EVENT)
     {
         processed += m_timer.processTimeEvents();
     }
+
+    // the events they change are synced with the rest before the next poll
+    for (const Task &proc : m_beforeSleepProcs)
+    {
+        proc();
+    }
     return processed;
 }
 
@@ -151,6 +360,7 @@ void Reactor::eventLoop(int flag)
     {
         processEvents(flag);
     }
+    clearLoopTime();
 }
 
 void Reactor::stopEventLoop()
@@ -163,11 +373,179 @@ void Reactor::setStart()
     m_isStopLoop = false;
 }
 
+void Reactor::addBeforeSleepProc(const Task &proc)
+{
+    m_beforeSleepProcs.push_back(proc);
+}
+
+void Reactor::postTask(const Task &task)
+{
+    bool needWakeup;
+    {
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        needWakeup = m_pendingTasks.empty();
+        m_pendingTasks.push_back(task);
+    }
+
+    // one byte in the pipe is enough to wake the loop up for all pending tasks
+    if (needWakeup)
+    {
+        char c = 0;
+        write(m_wakeupFds[1], &c, sizeof(c));
+    }
+}
+
+void Reactor::wakeupReadProc(int fd, int mask)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+    }
+
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(m_taskMutex);
+        tasks.swap(m_pendingTasks);
+    }
+    for (const auto &task : tasks)
+    {
+        task();
+    }
+}
+
+/*
+ * the buffer is moved in so it stays put until the kernel is done with it.
+ * only one send per fd, the stream order would be lost with more
+ */
+bool Reactor::submitSend(int fd, ChainBuffer &&buf, const SendProc &proc)
+{
+    if (!canSubmitSend() || buf.empty() || m_sendOfFd.count(fd) > 0)
+    {
+        return false;
+    }
+    uint64_t id = m_nextSendId++;
+    std::unique_ptr<PendingSend> ps(new PendingSend{fd, std::move(buf), {}, {}, proc, false});
+    issueSend(id, *ps);
+    m_sendOfFd[fd] = id;
+    m_pendingSends[id] = std::move(ps);
+    return true;
+}
+
+void Reactor::issueSend(uint64_t id, PendingSend &ps)
+{
+    size_t len;
+    ps.iov.resize(MAX_WRITE_IOVS);
+    int iovCnt = ps.buf.peek(ps.iov.data(), MAX_WRITE_IOVS, &len);
+    ps.iov.resize(iovCnt);
+    memset(&ps.msg, 0, sizeof(ps.msg));
+    ps.msg.msg_iov = ps.iov.data();
+    ps.msg.msg_iovlen = iovCnt;
+    m_demultiplexer->submitSendmsg(ps.fd, &ps.msg, id);
+}
+
+void Reactor::cancelSend(int fd)
+{
+    auto it = m_sendOfFd.find(fd);
+    if (it == m_sendOfFd.end())
+    {
+        return;
+    }
+    uint64_t id = it->second;
+    m_sendOfFd.erase(it);
+    if (m_pendingSends[id]->isWaitingPoll)
+    {
+        removeFileEvent(fd, EVENT_WRITABLE);
+        m_pendingSends.erase(id);
+        return;
+    }
+    // the buffer is freed when the completion comes
+    m_pendingSends[id]->proc = nullptr;
+    m_demultiplexer->cancelIo(id);
+}
+
+void Reactor::processCompletions()
+{
+    m_demultiplexer->takeCompletions(m_completions);
+    for (const IoCompletion &c : m_completions)
+    {
+        auto it = m_pendingSends.find(c.id);
+        if (it == m_pendingSends.end())
+        {
+            continue;
+        }
+        PendingSend &ps = *it->second;
+        if (!ps.proc)
+        {
+            m_pendingSends.erase(it);
+            continue;
+        }
+
+        int fd = ps.fd;
+        SendProc proc = ps.proc; // it may cancel the send or submit the next one
+        int res = c.res == 0 ? -EPIPE : c.res; // the socket took nothing of a non empty send
+        if (res == -EINTR)
+        {
+            issueSend(c.id, ps);
+            continue;
+        }
+        if (res == -EAGAIN)
+        {
+            // submitting again at once would spin, the rest goes when the socket is writable
+            ps.isWaitingPoll = true;
+            registerFileEvent(
+                fd,
+                EVENT_WRITABLE,
+                std::bind(
+                    &Reactor::resumeSendProc,
+                    this,
+                    std::placeholders::_1,
+                    std::placeholders::_2
+                )
+            );
+            continue;
+        }
+        if (res > 0)
+        {
+            ps.buf.consume(res);
+            if (!ps.buf.empty())
+            {
+                // a short send, the rest goes on its own
+                issueSend(c.id, ps);
+                proc(fd, res);
+                continue;
+            }
+        }
+        m_sendOfFd.erase(fd);
+        m_pendingSends.erase(it);
+        proc(fd, res);
+    }
+    m_completions.clear();
+}
+
+void Reactor::resumeSendProc(int fd, int mask)
+{
+    removeFileEvent(fd, EVENT_WRITABLE);
+    auto it = m_sendOfFd.find(fd);
+    if (it == m_sendOfFd.end())
+    {
+        return;
+    }
+    PendingSend &ps = *m_pendingSends[it->second];
+    ps.isWaitingPoll = false;
+    issueSend(it->second, ps);
+}
+
 long long Reactor::registerTimeEvent(long long milliseconds, TimeProc timeProc)
 {
     return m_timer.createTimeEvent(milliseconds, std::move(timeProc));
 }
 
+long long Reactor::registerTimeEventUs(long long microseconds, TimeProc timeProc)
+{
+    m_demultiplexer->enableHighResTimer();
+    return m_timer.createTimeEventUs(microseconds, std::move(timeProc));
+}
+
 int Reactor::removeTimeEvent(long long id)
 {
     return m_timer.deleteTimeEvent(id);
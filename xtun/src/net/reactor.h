@@ -1,16 +1,19 @@
 #ifndef __REACTOR_H__
 #define __REACTOR_H__
 
-#include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
+#include "buffer.h"
 #include "event.h"
 #include "event_demultiplexer.h"
 #ifdef __linux__
 #include "epoll_demultiplexer.h"
-#else
-#include "select_demultiplexer.h"
+#include "io_uring_demultiplexer.h"
 #endif // __linux__
+#include "select_demultiplexer.h"
 #include "timer.h"
 
 
@@ -19,30 +22,103 @@
 #define EVENT_LOOP_TIMER_EVENT 4
 #define EVENT_LOOP_ALL_EVENT (EVENT_LOOP_FILE_EVENT | EVENT_LOOP_TIMER_EVENT)
 
+using Task = std::function<void()>;
+// bytes of a submitted send the kernel took, or -errno once and the send is over
+using SendProc = std::function<void(int fd, ssize_t res)>;
+
+enum IO_BACKEND
+{
+  IO_BACKEND_EPOLL,
+  IO_BACKEND_IO_URING, // fall back to epoll if the kernel has no io_uring
+  IO_BACKEND_SELECT
+};
+
 class Reactor
 {
 private:
+  static IO_BACKEND s_ioBackend; // for all reactors made later
+  static bool s_isEdgeTriggered;
+
+  // a send handed to the kernel, the buffer is kept here until the completion comes
+  struct PendingSend
+  {
+    int fd;
+    ChainBuffer buf;
+    std::vector<struct iovec> iov;
+    struct msghdr msg;
+    SendProc proc;      // empty once canceled
+    bool isWaitingPoll; // the socket was full, nothing in the kernel until it is writable
+  };
+
+  // destroyed after the demultiplexer, the ring may read the buffers until it is closed
+  std::unordered_map<uint64_t, std::unique_ptr<PendingSend>> m_pendingSends;
+  std::unordered_map<int, uint64_t> m_sendOfFd; // the send in flight of each fd
+  uint64_t m_nextSendId{0};
+  IoCompletions m_completions;
+
   std::unique_ptr<EventDemultiplexer> m_demultiplexer;
-  EventHandlerMap m_fileEvents;
+  EventHandlerTable m_fileEvents;
+  std::vector<int> m_dirtyFds; // fds whose events changed in this loop
+  std::vector<int> m_activeFds; // fds to fire in next loop, see activateFileEvent
   FiredEvents m_firedEvents; // Multiplexed memory
   Timer m_timer;
 
   bool m_isStopLoop;
+  bool m_isEdgeTriggered;
+
+  // other threads post tasks here and wake the loop up through the pipe
+  int m_wakeupFds[2];
+  std::mutex m_taskMutex;
+  std::vector<Task> m_pendingTasks;
+
+  std::vector<Task> m_beforeSleepProcs;
 
   int processEvents(int flag);
+  int kernelMaskOf(int mask) const;
+  void markDirty(int fd, FileEvent &fe);
+  void syncDirtyEvents();
+  void dispatchFileEvent(int fd, int mask, int &processed);
+  void wakeupReadProc(int fd, int mask);
+  void issueSend(uint64_t id, PendingSend &ps);
+  void resumeSendProc(int fd, int mask);
+  void processCompletions();
 
 public:
   Reactor();
-  ~Reactor() = default;
+  ~Reactor();
+
+  static void setIoBackend(IO_BACKEND backend);
+  static void setEdgeTriggered(bool isEdgeTriggered); // only epoll supports it
+
+  // procs must read and write until EAGAIN, or call activateFileEvent to go on later
+  bool isEdgeTriggered() const { return m_isEdgeTriggered; }
 
   void eventLoop(int flag);
   void stopEventLoop();
+  bool isStopped() const { return m_isStopLoop; }
   void setStart();
 
-  void registerFileEvent(int fd, int mask, const FileProc& proc);
+  void postTask(const Task &task); // thread safe, task will run in the loop thread
+  // run at the end of every loop after all the events and timers, like redis beforesleep.
+  // owners flush here what the procs of the loop only queued, once per connection
+  void addBeforeSleepProc(const Task &proc);
+
+  bool registerFileEvent(int fd, int mask, const FileProc& proc); // false if fd is negative
   void removeFileEvent(int fd, int mask);
+  void setFileProc(int fd, int mask, const FileProc& proc); // only swap procs of registered events
+  // fire registered events in next loop as if they were polled, for procs that stop before EAGAIN
+  void activateFileEvent(int fd, int mask);
+
+  // completion style sends instead of waiting for writable, only with io_uring
+  bool canSubmitSend() const { return m_demultiplexer->canSubmitIo(); }
+  // the kernel sends all of buf by itself, short sends are submitted again. proc is told the bytes
+  // of each completion in a later loop, one send in flight per fd
+  bool submitSend(int fd, ChainBuffer &&buf, const SendProc &proc);
+  // proc of the send in flight on fd won't run any more, call it before closing fd
+  void cancelSend(int fd);
 
   long long registerTimeEvent(long long milliseconds, TimeProc timeProc);
+  long long registerTimeEventUs(long long microseconds, TimeProc timeProc); // timeProc returns microseconds too
   int removeTimeEvent(long long id);
 };
 
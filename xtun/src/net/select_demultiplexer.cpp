@@ -9,33 +9,29 @@ SelectDemultiplexer::SelectDemultiplexer()
     FD_ZERO(&m_rfds);
 }
 
-void SelectDemultiplexer::addEvent(const EventHandlerMap& fileEvents, int fd, int mask)
+void SelectDemultiplexer::modEvent(int fd, int oldMask, int newMask)
 {
-    if (mask & EVENT_READABLE)
+    if (newMask & EVENT_READABLE)
     {
         FD_SET(fd, &m_rfds);
     }
-    if (mask & EVENT_WRITABLE)
+    else
     {
-        FD_SET(fd, &m_wfds);
+        FD_CLR(fd, &m_rfds);
     }
-}
-
-void SelectDemultiplexer::delEvent(const EventHandlerMap& fileEvents, int fd, int mask)
-{
-    if (mask & EVENT_READABLE)
+    if (newMask & EVENT_WRITABLE)
     {
-        FD_CLR(fd, &m_rfds);
+        FD_SET(fd, &m_wfds);
     }
-    if (mask & EVENT_WRITABLE)
+    else
     {
         FD_CLR(fd, &m_wfds);
     }
 }
 
-int SelectDemultiplexer::pollEvent(const std::map<int, FileEvent> &fileEvents, FiredEvents &firedEvents, timeval *tvp)
+int SelectDemultiplexer::pollEvent(const EventHandlerTable &fileEvents, FiredEvents &firedEvents, timeval *tvp)
 {
-    int max_fd = fileEvents.rbegin()->first + 1;
+    int max_fd = fileEvents.maxFd() + 1;
     memcpy(&m_tmp_rfds, &m_rfds, sizeof(fd_set));
     memcpy(&m_tmp_wfds, &m_wfds, sizeof(fd_set));
 
@@ -55,10 +51,14 @@ int SelectDemultiplexer::pollEvent(const std::map<int, FileEvent> &fileEvents, F
     {
         firedEvents.resize(num);
     }
-    for (const auto & fileEvent : fileEvents)
+    for (fd = 0; fd < max_fd; fd++)
     {
-        fd = fileEvent.first;
-        mask = fileEvent.second.mask;
+        const FileEvent *fe = fileEvents.find(fd);
+        if (fe == nullptr)
+        {
+            continue;
+        }
+        mask = fe->mask;
         int tmpMask = 0;
         if((mask & EVENT_READABLE) && FD_ISSET(fd, &m_tmp_rfds))
         {
@@ -10,9 +10,8 @@ public:
   SelectDemultiplexer();
   ~SelectDemultiplexer() override = default;
 
-  void addEvent(const EventHandlerMap& fileEvents, int fd, int mask) override;
-  void delEvent(const EventHandlerMap& fileEvents, int fd, int mask) override;
-  int pollEvent(const EventHandlerMap &fileEvents,
+  void modEvent(int fd, int oldMask, int newMask) override;
+  int pollEvent(const EventHandlerTable &fileEvents,
                         FiredEvents &firedEvents, timeval *tvp) override;
 
 private:
@@ -0,0 +1,198 @@
+#include "splice_relay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tnet.h"
+
+
+SpliceRelay::SpliceRelay(Reactor &reactor, int fd1, int fd2, const DoneProc &doneProc)
+    : m_reactor(reactor), m_doneProc(doneProc)
+{
+    m_dirs[0].from = fd1;
+    m_dirs[0].to = fd2;
+    m_dirs[1].from = fd2;
+    m_dirs[1].to = fd1;
+}
+
+SpliceRelay::~SpliceRelay()
+{
+    m_reactor.removeFileEvent(m_dirs[0].from, EVENT_READABLE | EVENT_WRITABLE);
+    m_reactor.removeFileEvent(m_dirs[0].to, EVENT_READABLE | EVENT_WRITABLE);
+    for (Direction &dir : m_dirs)
+    {
+        for (int fd : dir.pipe)
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+    }
+}
+
+bool SpliceRelay::isSupported()
+{
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif // __linux__
+}
+
+bool SpliceRelay::start()
+{
+    for (Direction &dir : m_dirs)
+    {
+        if (pipe(dir.pipe) == -1)
+        {
+            return false;
+        }
+#ifdef F_SETPIPE_SZ
+        // fewer splices per wakeup, the default 64KB is kept if the limit is lower
+        fcntl(dir.pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+#endif // F_SETPIPE_SZ
+    }
+    for (Direction &dir : m_dirs)
+    {
+        updateEvents(dir);
+    }
+    return true;
+}
+
+void SpliceRelay::readProc(int fd, int mask)
+{
+    transfer(m_dirs[0].from == fd ? m_dirs[0] : m_dirs[1]);
+}
+
+void SpliceRelay::writeProc(int fd, int mask)
+{
+    transfer(m_dirs[0].to == fd ? m_dirs[0] : m_dirs[1]);
+}
+
+void SpliceRelay::transfer(Direction &dir)
+{
+    if (!pump(dir) || (m_dirs[0].isShut && m_dirs[1].isShut))
+    {
+        // the proc may delete the relay and itself with it
+        DoneProc doneProc = m_doneProc;
+        doneProc();
+    }
+}
+
+bool SpliceRelay::pump(Direction &dir)
+{
+    size_t moved = 0;
+    bool canRead = !dir.isEof;
+    while (moved < RELAY_BUDGET_PER_EVENT)
+    {
+        bool isProgress = false;
+        if (canRead)
+        {
+            ssize_t n = tnet::splice_data(dir.from, dir.pipe[1], RELAY_PIPE_SIZE);
+            if (n > 0)
+            {
+                dir.pending += n;
+                isProgress = true;
+            }
+            else if (n == 0)
+            {
+                dir.isEof = true;
+                canRead = false;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // a full pipe says EAGAIN too, the socket counts as drained only with an empty pipe,
+                // edge triggered epoll won't tell the rest again
+                canRead = dir.pending > 0;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        if (dir.pending > 0)
+        {
+            ssize_t n = tnet::splice_data(dir.pipe[0], dir.to, dir.pending);
+            if (n > 0)
+            {
+                dir.pending -= n;
+                moved += n;
+                isProgress = true;
+            }
+            else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+        }
+        if (!isProgress)
+        {
+            break;
+        }
+    }
+
+    if (dir.isEof && dir.pending == 0 && !dir.isShut)
+    {
+        shutdown(dir.to, SHUT_WR);
+        dir.isShut = true;
+    }
+    updateEvents(dir);
+    if (moved >= RELAY_BUDGET_PER_EVENT)
+    {
+        // the budget is used up, go on in next loop
+        if (dir.pending > 0)
+        {
+            m_reactor.activateFileEvent(dir.to, EVENT_WRITABLE);
+        }
+        else
+        {
+            m_reactor.activateFileEvent(dir.from, EVENT_READABLE);
+        }
+    }
+    return true;
+}
+
+void SpliceRelay::updateEvents(Direction &dir)
+{
+    bool isReading = !dir.isEof && dir.pending == 0;
+    if (isReading && !dir.isReading)
+    {
+        m_reactor.registerFileEvent(
+            dir.from,
+            EVENT_READABLE,
+            std::bind(
+                &SpliceRelay::readProc,
+                this,
+                std::placeholders::_1,
+                std::placeholders::_2
+            )
+        );
+    }
+    else if (!isReading && dir.isReading)
+    {
+        m_reactor.removeFileEvent(dir.from, EVENT_READABLE);
+    }
+    dir.isReading = isReading;
+
+    bool isWriting = dir.pending > 0;
+    if (isWriting && !dir.isWriting)
+    {
+        m_reactor.registerFileEvent(
+            dir.to,
+            EVENT_WRITABLE,
+            std::bind(
+                &SpliceRelay::writeProc,
+                this,
+                std::placeholders::_1,
+                std::placeholders::_2
+            )
+        );
+    }
+    else if (!isWriting && dir.isWriting)
+    {
+        m_reactor.removeFileEvent(dir.to, EVENT_WRITABLE);
+    }
+    dir.isWriting = isWriting;
+}
@@ -0,0 +1,59 @@
+#ifndef __SPLICE_RELAY_H__
+#define __SPLICE_RELAY_H__
+
+#include <stddef.h>
+#include <functional>
+
+#include "reactor.h"
+
+const size_t RELAY_PIPE_SIZE = 1024 * 256;          // asked for each direction, the kernel may give less
+const size_t RELAY_BUDGET_PER_EVENT = 1024 * 256;   // bytes moved one way per wakeup, others need their turn
+
+/*
+ * moves the bytes of two sockets both ways with splice through a pipe for each
+ * direction, the payload never enters userspace. a direction reads only while its
+ * pipe is empty and waits for the writable event of the other socket otherwise, the
+ * socket buffers do the buffering. an end of file is passed on as a shutdown for
+ * writing once the pipe is drained, the relay is done when both ways are shut or
+ * one of the sockets fails. the sockets must be non-blocking, they are not closed here.
+ */
+class SpliceRelay
+{
+  public:
+    using DoneProc = std::function<void()>;
+
+    // doneProc may destroy the relay, nothing of it is touched after the call
+    SpliceRelay(Reactor &reactor, int fd1, int fd2, const DoneProc &doneProc);
+    ~SpliceRelay(); // closes the pipes and removes the events of both sockets
+    SpliceRelay(const SpliceRelay &) = delete;
+    SpliceRelay &operator=(const SpliceRelay &) = delete;
+
+    static bool isSupported(); // splice is linux only
+
+    bool start(); // false if the pipes can't be made
+
+  private:
+    struct Direction
+    {
+        int from;
+        int to;
+        int pipe[2]{-1, -1};
+        size_t pending{0};  // bytes in the pipe
+        bool isEof{false};  // from has nothing more
+        bool isShut{false}; // to is shut down for writing
+        bool isReading{false}; // the events registered now, a running proc is never replaced
+        bool isWriting{false};
+    };
+
+    Reactor &m_reactor;
+    Direction m_dirs[2];
+    DoneProc m_doneProc;
+
+    void readProc(int fd, int mask);
+    void writeProc(int fd, int mask);
+    void transfer(Direction &dir);
+    bool pump(Direction &dir); // false if a socket fails
+    void updateEvents(Direction &dir);
+};
+
+#endif // __SPLICE_RELAY_H__
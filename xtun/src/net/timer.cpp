@@ -2,116 +2,204 @@
 
 #include <utility>
 
-Timer::Timer() : m_timeEventNextId(1)
+const size_t HEAP_INDEX_NONE = static_cast<size_t>(-1);
+
+
+static thread_local long long t_loopTimeUs = 0; // 0 表示当前线程没有运行中的循环
+
+long long getMonotonicUs()
 {
-    m_lastTime = time(nullptr);
+    struct timespec ts{};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void updateLoopTime()
+{
+    t_loopTimeUs = getMonotonicUs();
+}
+
+void clearLoopTime()
+{
+    t_loopTimeUs = 0;
+}
+
+long long getLoopTimeUs()
+{
+    return t_loopTimeUs != 0 ? t_loopTimeUs : getMonotonicUs();
 }
 
 void getTime(long *seconds, long *milliseconds)
 {
-    struct timeval tv{};
+    long long now = getLoopTimeUs();
+    *seconds = now / 1000000;
+    *milliseconds = (now % 1000000) / 1000;
+}
 
-    gettimeofday(&tv, nullptr);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec / 1000;
+Timer::Timer() : m_timeEventNextId(1), m_runningId(-1), m_isRunningDeleted(false)
+{
 }
 
-void addMillisecondsToNow(long long milliseconds, long *sec, long *ms)
+bool Timer::less(size_t i, size_t j) const
 {
-    long cur_sec, cur_ms, when_sec, when_ms;
+    return m_heap[i]->whenUs < m_heap[j]->whenUs;
+}
 
-    getTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds / 1000;
-    when_ms = cur_ms + milliseconds % 1000;
-    if (when_ms >= 1000)
+void Timer::swapNode(size_t i, size_t j)
+{
+    std::swap(m_heap[i], m_heap[j]);
+    m_heap[i]->heapIndex = i;
+    m_heap[j]->heapIndex = j;
+}
+
+void Timer::siftUp(size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!less(i, parent))
+        {
+            break;
+        }
+        swapNode(i, parent);
+        i = parent;
+    }
+}
+
+void Timer::siftDown(size_t i)
+{
+    size_t n = m_heap.size();
+    while (true)
     {
-        when_sec++;
-        when_ms -= 1000;
+        size_t minIdx = i;
+        size_t left = i * 2 + 1;
+        size_t right = left + 1;
+        if (left < n && less(left, minIdx))
+        {
+            minIdx = left;
+        }
+        if (right < n && less(right, minIdx))
+        {
+            minIdx = right;
+        }
+        if (minIdx == i)
+        {
+            break;
+        }
+        swapNode(i, minIdx);
+        i = minIdx;
+    }
+}
+
+void Timer::heapPush(TimeEvent *te)
+{
+    te->heapIndex = m_heap.size();
+    m_heap.push_back(te);
+    siftUp(te->heapIndex);
+}
+
+void Timer::heapRemove(TimeEvent *te)
+{
+    size_t i = te->heapIndex;
+    if (i == HEAP_INDEX_NONE)
+    {
+        return;
+    }
+    size_t last = m_heap.size() - 1;
+    if (i != last)
+    {
+        swapNode(i, last);
+    }
+    m_heap.pop_back();
+    te->heapIndex = HEAP_INDEX_NONE;
+    if (i != last)
+    {
+        siftDown(i);
+        siftUp(i);
     }
-    *sec = when_sec;
-    *ms = when_ms;
 }
 
 long long Timer::createTimeEvent(long long milliseconds, TimeProc timeProc)
+{
+    long long id = createTimeEventUs(milliseconds * 1000, std::move(timeProc));
+    m_timeEvents[id].unitUs = 1000;
+    return id;
+}
+
+long long Timer::createTimeEventUs(long long microseconds, TimeProc timeProc)
 {
     long long id = m_timeEventNextId++;
-    TimeEvent te;
+    TimeEvent &te = m_timeEvents[id];
     te.id = id;
-    addMillisecondsToNow(milliseconds, &te.when_sec, &te.when_ms);
+    te.whenUs = getLoopTimeUs() + microseconds;
+    te.unitUs = 1;
     te.timeProc = std::move(timeProc);
-    m_timeEvents.push_back(te);
+    heapPush(&te);
     return id;
 }
 
 int Timer::deleteTimeEvent(long long id)
 {
-    for (auto it = m_timeEvents.begin(); it != m_timeEvents.end(); it++)
+    auto it = m_timeEvents.find(id);
+    if (it == m_timeEvents.end())
     {
-        if (it->id == id)
-        {
-            m_timeEvents.erase(it);
-            return TIMER_OK;
-        }
+        return TIMER_ERR;
+    }
+    if (id == m_runningId)
+    {
+        // 回调还在执行，执行完再删除
+        m_isRunningDeleted = true;
+        return TIMER_OK;
     }
-    return TIMER_ERR;
+    heapRemove(&it->second);
+    m_timeEvents.erase(it);
+    return TIMER_OK;
 }
 
-TimeEvent Timer::getNearestTimer()
+const TimeEvent *Timer::getNearestTimer() const
 {
-    TimeEvent minVal;
-    minVal.id = -1;
-    for (auto it = m_timeEvents.begin(); it != m_timeEvents.end(); it++)
-    {
-        if (it == m_timeEvents.begin() || *it < minVal)
-        {
-            minVal = *it;
-        }
-    }
-    return minVal;
+    return m_heap.empty() ? nullptr : m_heap[0];
 }
 
 int Timer::processTimeEvents()
 {
-    long now_sec, now_ms, when_sec, when_ms;
-    long long id;
     int nProcessed = 0;
-    time_t now = time(nullptr);
 
-    /* 上次处理的时间一定是比这次的时间戳小的，
-     * 处理一种情况是把系统时间调的很大，然后又调正确 */
-    if (now < m_lastTime)
+    // 先取出所有到期的定时器，回调里新建的定时器本轮不执行
+    long long nowUs = getLoopTimeUs();
+    m_dueIds.clear();
+    while (!m_heap.empty() && m_heap[0]->whenUs <= nowUs)
     {
-        for (auto & m_timeEvent : m_timeEvents)
-        {
-            m_timeEvent.when_sec = 0;
-        }
+        m_dueIds.push_back(m_heap[0]->id);
+        heapRemove(m_heap[0]);
     }
-    m_lastTime = now;
 
-    for (auto it = m_timeEvents.begin(); it != m_timeEvents.end();)
+    for (long long id : m_dueIds)
     {
-        getTime(&now_sec, &now_ms);
-        if (now_sec > it->when_sec ||
-            (now_sec == it->when_sec && now_ms >= it->when_ms))
+        auto it = m_timeEvents.find(id);
+        if (it == m_timeEvents.end())
         {
-            int ret;
-            id = it->id;
-            ret = it->timeProc(id);
-            nProcessed++;
-            if (ret < 0)
-            {
-                it = m_timeEvents.erase(it);
-            }
-            else
-            {
-                addMillisecondsToNow(ret, &when_sec, &when_ms);
-                it->when_sec = when_sec;
-                it->when_ms = when_ms;
-                it++;
-            }
+            // 被之前的回调删除了
             continue;
         }
-        it++;
+        TimeEvent *te = &it->second;
+
+        m_runningId = id;
+        m_isRunningDeleted = false;
+        int ret = te->timeProc(id);
+        m_runningId = -1;
+        nProcessed++;
+
+        if (ret < 0 || m_isRunningDeleted)
+        {
+            m_timeEvents.erase(id);
+        }
+        else
+        {
+            te->whenUs = nowUs + ret * te->unitUs;
+            heapPush(te);
+        }
     }
     return nProcessed;
 }
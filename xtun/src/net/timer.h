@@ -2,9 +2,9 @@
 #define __TIMER_POOL_H__
 
 #include <functional>
-#include <list>
-#include <sys/time.h>
-#include <time.h> //  time(1)
+#include <unordered_map>
+#include <vector>
+#include <time.h>
 
 #define TIMER_OK 0
 #define TIMER_ERR -1
@@ -15,48 +15,54 @@ using TimeProc = std::function<int(long long id)>;
 struct TimeEvent
 {
     long long id;
-    long when_sec;
-    long when_ms;
+    long long whenUs;   // 到期的时间，单调时钟，微秒
+    long long unitUs;   // timeProc 返回值的单位，毫秒定时器是1000
+    size_t heapIndex;   // 在最小堆中的位置
     TimeProc timeProc;
-
-    friend bool operator<(const TimeEvent &te1, const TimeEvent &te2)
-    {
-        if (te1.when_sec != te2.when_sec)
-        {
-            return te1.when_sec < te2.when_sec;
-        }
-        if (te1.when_ms != te2.when_ms)
-        {
-            return te1.when_ms < te2.when_ms;
-        }
-        return false;
-    }
-
-    friend bool operator==(const TimeEvent &te1, const TimeEvent &te2)
-    {
-        return te1.id == te2.id;
-    }
 };
 
 
+/*
+ * 单调时钟(CLOCK_MONOTONIC)，不受修改系统时间影响。
+ * reactor 每轮循环更新一次当前线程的缓存时间，处理事件时直接用缓存，
+ * 没有运行中的循环时读真实时钟
+ */
+long long getMonotonicUs();
+void updateLoopTime();
+void clearLoopTime();
+long long getLoopTimeUs();
 void getTime(long *seconds, long *milliseconds);
-void addMillisecondsToNow(long long milliseconds, long *sec, long *ms);
 
 
+/*
+ * 最小堆 + id索引:
+ * 最近的定时器 O(1), 添加/删除 O(log n), 按id查找 O(1)
+ */
 class Timer
 {
   private:
     long long m_timeEventNextId;
-    std::list<TimeEvent> m_timeEvents;
-    time_t m_lastTime;
+    std::unordered_map<long long, TimeEvent> m_timeEvents; // id -> event, 元素地址不会变
+    std::vector<TimeEvent *> m_heap;
+    std::vector<long long> m_dueIds;  // 复用内存
+    long long m_runningId;            // 正在执行的定时器，在回调里删除自己时只做标记
+    bool m_isRunningDeleted;
+
+    bool less(size_t i, size_t j) const;
+    void swapNode(size_t i, size_t j);
+    void siftUp(size_t i);
+    void siftDown(size_t i);
+    void heapPush(TimeEvent *te);
+    void heapRemove(TimeEvent *te);
 
   public:
     Timer();
     ~Timer() = default;
     long long createTimeEvent(long long milliseconds, TimeProc timeProc);
+    long long createTimeEventUs(long long microseconds, TimeProc timeProc); // timeProc 也返回微秒
     int deleteTimeEvent(long long id);
-    TimeEvent getNearestTimer();
+    const TimeEvent *getNearestTimer() const; // nullptr if there is no timer
     int processTimeEvents();
 };
 
-#endif // __TIMER_POOL_H__
\ No newline at end of file
+#endif // __TIMER_POOL_H__
@@ -103,6 +103,40 @@ int tnet::tcp_generic_connect(char *addr, unsigned short port)
     return fd;
 }
 
+// 不等连接完成就返回, 可写时用socket_error看结果
+int tnet::tcp_nonblock_connect(char *addr, unsigned short port)
+{
+    int fd = tnet::tcp_socket();
+    if (fd == -1)
+    {
+        printf("socket err\n");
+        return NET_ERR;
+    }
+    if (tnet::non_block(fd) == NET_ERR)
+    {
+        close(fd);
+        return NET_ERR;
+    }
+    int ret = tnet::connect(fd, addr, port);
+    if (ret == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NET_ERR;
+    }
+    return fd;
+}
+
+int tnet::socket_error(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    {
+        return errno;
+    }
+    return err;
+}
+
 // 接收fd1的数据，转发给fd2
 int tnet::tcp_dispatch_data(int fd1, int fd2, char *buf, size_t max_buf_size)
 {
@@ -138,6 +172,27 @@ int tnet::tcp_dispatch_data(int fd1, int fd2, char *buf, size_t max_buf_size)
     return NET_OK;
 }
 
+// iov里的所有段用一次sendmsg发出去, fd是阻塞的也不会等
+ssize_t tnet::send_iov(int fd, const struct iovec *iov, int iov_cnt)
+{
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = iov_cnt;
+    return sendmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+// fd_in或fd_out有一个是管道, 数据不经过用户空间; 只有linux有splice
+ssize_t tnet::splice_data(int fd_in, int fd_out, size_t len)
+{
+#ifdef __linux__
+    return splice(fd_in, nullptr, fd_out, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif // __linux__
+}
+
 int tnet::tcp_accept(int fd, char *ip, size_t ip_len, int *port)
 {
     sockaddr_in cli_addr;
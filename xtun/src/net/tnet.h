@@ -2,6 +2,8 @@
 #define TNET_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define NET_OK 0
 #define NET_ERR -1
@@ -17,8 +19,12 @@ public:
     static int block(int fd);
     static int connect(int cfd, char *addr, unsigned short port);
     static int tcp_generic_connect(char *addr, unsigned short port);
+    static int tcp_nonblock_connect(char *addr, unsigned short port); // writable when done, see socket_error
+    static int socket_error(int fd); // the error of a connect in progress, 0 if connected
     static int tcp_accept(int fd, char *ip, size_t ip_len, int *port);
     static int tcp_dispatch_data(int fd1, int fd2, char *buf, size_t max_buf_size);
+    static ssize_t send_iov(int fd, const struct iovec *iov, int iov_cnt);
+    static ssize_t splice_data(int fd_in, int fd_out, size_t len);
 };
 
 
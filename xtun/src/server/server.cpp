@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <netinet/in.h>
 #include <cstring>
 
 #include "server.h"
 
+#include "../msg/drbg.h"
 #include "../third_part/md5.h"
 
 
@@ -12,8 +14,19 @@ Server::Server(std::shared_ptr<Logger> &logger, unsigned short port)
     initServer();
 }
 
+Server::Server(std::shared_ptr<Logger> &logger, Server *acceptor)
+    : m_serverSocketFd(-1), m_serverPort(0), m_pLogger(logger), m_isWorker(true),
+      m_isPassthrough(acceptor->m_isPassthrough), m_acceptor(acceptor)
+{
+    memcpy(m_serverPassword, acceptor->m_serverPassword, sizeof(m_serverPassword));
+    initCryptors();
+    initServer();
+}
+
 Server::~Server()
 {
+    stopWorkers();
+
     if (m_serverSocketFd != -1)
     {
         close(m_serverSocketFd);
@@ -68,10 +81,13 @@ int Server::listenControl()
 
 void Server::initServer()
 {
-    int ret = listenControl();
-    if (ret == -1)
+    if (!m_isWorker)
     {
-        exit(-1);
+        int ret = listenControl();
+        if (ret == -1)
+        {
+            exit(-1);
+        }
     }
 
     m_heartbeatTimerId = m_reactor.registerTimeEvent(
@@ -82,11 +98,18 @@ void Server::initServer()
             std::placeholders::_1
         )
     );
+    m_reactor.addBeforeSleepProc(std::bind(&Server::flushDirtyConns, this));
 }
 
 void Server::serverAcceptProc(int fd, int mask)
 {
-    if (mask & EVENT_READABLE)
+    if (!(mask & EVENT_READABLE))
+    {
+        return;
+    }
+
+    // accept until EAGAIN, edge triggered epoll won't tell the left connections again
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++)
     {
         char ip[INET_ADDRSTRLEN];
         int port;
@@ -103,36 +126,59 @@ void Server::serverAcceptProc(int fd, int mask)
         printf("serverAcceptProc new conn from %s:%d\n", ip, port);
         m_pLogger->info("new client connection from %s:%d", ip, port);
 
-        m_mapClients[connfd];
-        updateClientHeartbeat(connfd);
-
-        tnet::non_block(connfd);
-        m_reactor.registerFileEvent(
-            connfd,
-            EVENT_READABLE,
-            std::bind(
-                &Server::clientAuthProc,
-                this,
-                std::placeholders::_1,
-                std::placeholders::_2
-            )
-        );
+        Server *worker = nextWorker();
+        if (worker == this)
+        {
+            addClient(connfd);
+        }
+        else
+        {
+            worker->m_reactor.postTask(std::bind(&Server::addClient, worker, connfd));
+        }
     }
+    m_reactor.activateFileEvent(fd, EVENT_READABLE);
+}
+
+// round robin, this server is also one of the workers
+Server *Server::nextWorker()
+{
+    size_t idx = m_nextWorker++ % (m_workers.size() + 1);
+    return idx == 0 ? this : m_workers[idx - 1].get();
+}
+
+// run in the thread of the worker which the client belongs to
+void Server::addClient(int cfd)
+{
+    m_mapClients[cfd];
+    updateClientHeartbeat(cfd);
+
+    tnet::non_block(cfd);
+    m_reactor.registerFileEvent(
+        cfd,
+        EVENT_READABLE,
+        std::bind(
+            &Server::clientAuthProc,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
 }
 
 // ---------------------------------
-void Server::clientSafeRecv(int cfd, const std::function<void(int cfd, size_t dataSize)>& callback)
+int Server::clientSafeRecv(int cfd, const std::function<void(int cfd, size_t dataSize)>& callback)
 {
     int ret;
+    ClientInfo &client = m_mapClients[cfd];
     // there is not header init if data len is 0
-    size_t targetSize = m_mapClients[cfd].header.ensureTargetDataSize();
-    if (m_mapClients[cfd].isRecvBufFull())
+    size_t targetSize = client.header.ensureTargetDataSize();
+    if (!client.recvBuf)
     {
-        return;
+        client.recvBuf = acquireChunk();
     }
 
-    ret = recv(cfd, m_mapClients[cfd].recvBuf + m_mapClients[cfd].recvNum,
-                targetSize - m_mapClients[cfd].recvNum, MSG_DONTWAIT);
+    ret = recv(cfd, client.recvBuf->data + client.recvNum,
+                targetSize - client.recvNum, MSG_DONTWAIT);
     
     if (ret == -1)
     {
@@ -141,75 +187,117 @@ void Server::clientSafeRecv(int cfd, const std::function<void(int cfd, size_t da
             printf("recv client data err: %d\n", errno);
             m_pLogger->err("recv client data err: %d\n", errno);
         }
-        return;
+        else if (client.recvNum == 0 && client.header.dataLen == 0)
+        {
+            client.recvBuf.reset(); // nothing half received, give the chunk back
+        }
+        return -1;
     }
     else if (ret == 0)
     {
         deleteClient(cfd);
+        return 0;
     }
-    else if (ret > 0)
+
+    client.recvNum += ret;
+    if (client.recvNum == targetSize)
     {
-        m_mapClients[cfd].recvNum += ret;
+        client.recvNum = 0;
 
-        if (m_mapClients[cfd].recvNum == targetSize)
+        // targetSize = header size or data size, a record may be as long as a header
+        if (client.header.dataLen == 0)
         {
-            m_mapClients[cfd].recvNum = 0;
-
-            // targetSize = header size or data size
-            if (targetSize == sizeof(DataHeader))
+            memcpy(&client.header, client.recvBuf->data, targetSize);
+            if (!MsgUtil::isValidRecordSize(client.header.dataLen))
             {
-                memcpy(&m_mapClients[cfd].header, m_mapClients[cfd].recvBuf, targetSize);
+                printf("bad record size from client: %u\n", client.header.dataLen);
+                m_pLogger->err("bad record size from client: %u", client.header.dataLen);
+                deleteClient(cfd);
+                return 0;
             }
-            else
+        }
+        else
+        {
+            uint32_t realDataSize = clientCryptor(cfd)->decrypt(
+                client.header.iv, 
+                (uint8_t*)client.recvBuf->data, 
+                targetSize
+            );
+            if (realDataSize == DECRYPT_ERR && client.status == CLIENT_STATUS_PW_OK)
             {
-                uint32_t realDataSize = m_pCryptor->decrypt(
-                    m_mapClients[cfd].header.iv, 
-                    (uint8_t*)m_mapClients[cfd].recvBuf, 
-                    targetSize
-                );
+                // a wrong password is told to the client in the auth reply
+                printf("bad record from client: %d\n", cfd);
+                m_pLogger->err("bad record from client: %d", cfd);
+                deleteClient(cfd);
+                return 0;
+            }
 
-                // if recv all done, we callback
-                callback(cfd, realDataSize);
+            // if recv all done, we callback
+            callback(cfd, realDataSize);
 
-                // remember init datalen for next recv
-                m_mapClients[cfd].header.dataLen = 0;
+            // the callback may delete the client
+            auto it = m_mapClients.find(cfd);
+            if (it == m_mapClients.end())
+            {
+                return 0;
             }
+            // remember init datalen for next recv
+            it->second.header.dataLen = 0;
         }
     }
+    return ret;
 }
 
 // befor use this method, ensure you have filled the buf
 void Server::clientSafeSend(int cfd, const std::function<void(int cfd)>& callback)
 {
-    int ret = send(cfd, &m_mapClients[cfd].sendBuf, m_mapClients[cfd].sendSize, MSG_DONTWAIT);
-
-    if (ret == -1)
+    ClientInfo &client = m_mapClients[cfd];
+    size_t budget = READ_BUDGET_PER_EVENT;
+    bool isSocketFull = false;
+    while (!isSocketFull)
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        // the users take their turns, then the frames queued since the last flush go as one record
+        budget -= std::min(scheduleUserReads(cfd, budget), budget);
+        sealClientRecord(cfd);
+        if (client.sendQueue.empty())
         {
-            printf("clientSafeSend err: %d\n", errno);
-            m_pLogger->err("clientSafeSend err: %d\n", errno);
-            deleteClient(cfd);
+            break;
         }
-    }
-    else if (ret > 0)
-    {
-        m_mapClients[cfd].sendSize -= ret;
 
-        if (m_mapClients[cfd].sendSize == 0)
+        struct iovec iov[MAX_WRITE_IOVS];
+        size_t len;
+        int iovCnt = client.sendQueue.peek(iov, MAX_WRITE_IOVS, &len);
+        int ret = tnet::send_iov(cfd, iov, iovCnt);
+        if (ret == -1)
         {
-            callback(cfd);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("clientSafeSend err: %d\n", errno);
+                m_pLogger->err("clientSafeSend err: %d\n", errno);
+                deleteClient(cfd);
+                return;
+            }
+            isSocketFull = true;
+            break;
         }
-        else
+
+        client.sendQueue.consume(ret);
+        isSocketFull = static_cast<size_t>(ret) < len;
+    }
+
+    client.isSocketFull = isSocketFull;
+    if (!client.activeUsers.empty())
+    {
+        if (!isSocketFull)
         {
-            printf("+++++++++++++++++++++++++++++!\n");
-            memmove(
-                m_mapClients[cfd].sendBuf, 
-                m_mapClients[cfd].sendBuf + ret, 
-                m_mapClients[cfd].sendSize
-            );
+            // the budget is used up, the round goes on in next loop
+            m_reactor.activateFileEvent(cfd, EVENT_WRITABLE);
         }
     }
+    else if (client.sendQueue.empty())
+    {
+        callback(cfd);
+    }
 }
 // -----------------------------
 
@@ -222,7 +310,7 @@ void Server::clientAuthProc(int cfd, int mask)
         return;
     }
 
-    clientSafeRecv(
+    int ret = clientSafeRecv(
         cfd, 
         std::bind(
             &Server::checkClientAuthResult, 
@@ -231,22 +319,55 @@ void Server::clientAuthProc(int cfd, int mask)
             std::placeholders::_2
         )
     );
+    if (ret > 0)
+    {
+        // a record comes in more than one read, edge triggered epoll won't tell the rest again
+        m_reactor.activateFileEvent(cfd, EVENT_READABLE);
+    }
 }
 
 void Server::checkClientAuthResult(int cfd, size_t dataSize)
 {
-    if (dataSize != sizeof(m_serverPassword))
+    if (dataSize == DECRYPT_ERR)
+    {
+        // encrypted with another key
+        processClientAuthResult(cfd, false);
+        return;
+    }
+    if (dataSize == sizeof(DataBindMsg)
+        && memcmp(m_mapClients[cfd].recvBuf->data, DATA_BIND_TOKEN, sizeof(DATA_BIND_TOKEN)) == 0)
+    {
+        // 不是新客户端, 是一个客户端给它的用户连过来的数据连接
+        DataBindMsg msg;
+        memcpy(&msg, m_mapClients[cfd].recvBuf->data, sizeof(msg));
+        processDataBind(cfd, msg);
+        return;
+    }
+    if (dataSize < sizeof(m_serverPassword) || dataSize > sizeof(AuthRequestMsg))
     {
         printf(
             "encrpt ClientAuthResult data len not good! expect: %lu, infact: %lu\n", 
-            sizeof(m_serverPassword), dataSize
+            sizeof(AuthRequestMsg), dataSize
         );
         return;
     }
 
+    AuthRequestMsg request{};
+    memcpy(&request, m_mapClients[cfd].recvBuf->data, dataSize); // old clients send the password only
+    ClientInfo &client = m_mapClients[cfd];
+    client.cryptMethod = chooseCryptMethod(request.cryptMethods);
+    client.frameVersion = std::min<uint8_t>(request.frameVersion, FRAME_VERSION_LATEST);
+    client.dataMode = request.dataMode == DATA_MODE_SPLICE && m_isPassthrough ? DATA_MODE_SPLICE : DATA_MODE_TUNNEL;
+    // old clients read one message per record
+    for (FrameBatcher *batcher : {&client.ctrlBatcher, &client.batcher})
+    {
+        batcher->setBatching(dataSize > sizeof(m_serverPassword));
+        batcher->setFrameVersion(client.frameVersion);
+    }
+
     processClientAuthResult(
         cfd,
-        strncmp(m_serverPassword, m_mapClients[cfd].recvBuf, sizeof(m_serverPassword)) == 0
+        strncmp(m_serverPassword, request.password, sizeof(m_serverPassword)) == 0
     );
 }
 
@@ -255,18 +376,27 @@ void Server::processClientAuthResult(int cfd, bool isGood)
     if (isGood)
     {
         m_mapClients[cfd].status = CLIENT_STATUS_PW_OK;
+        if (m_mapClients[cfd].dataMode == DATA_MODE_SPLICE)
+        {
+            registerSession(cfd);
+        }
     }
     else
     {
         m_mapClients[cfd].status = CLIENT_STATUS_PW_WRONG;
     }
 
-    m_mapClients[cfd].sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-            (uint8_t *) AUTH_TOKEN,
-            sizeof(AUTH_TOKEN)
-    );
+    AuthReplyMsg reply{};
+    memcpy(reply.token, AUTH_TOKEN, sizeof(AUTH_TOKEN));
+    reply.cryptMethod = m_mapClients[cfd].cryptMethod;
+    reply.frameVersion = m_mapClients[cfd].frameVersion;
+    reply.dataMode = m_mapClients[cfd].dataMode;
+    memcpy(reply.sessionToken, &m_mapClients[cfd].sessionToken, sizeof(reply.sessionToken));
+
+    // the reply is still cbc, the negotiated method starts with the next record
+    uint8_t buf[MsgUtil::ensureEncryptedDataSize(sizeof(reply))];
+    uint32_t replyLen = MsgUtil::packEncryptedData(m_pCryptor, buf, (uint8_t *) &reply, sizeof(reply));
+    m_mapClients[cfd].sendQueue.append(LANE_CONTROL, (char *) buf, replyLen);
 
     m_reactor.registerFileEvent(
         cfd,
@@ -301,7 +431,7 @@ void Server::onReplyClientAuthDone(int cfd)
     if (m_mapClients[cfd].status == CLIENT_STATUS_PW_OK)
     {
         m_reactor.removeFileEvent(cfd, EVENT_WRITABLE);
-        m_reactor.registerFileEvent(
+        m_reactor.setFileProc(
             cfd,
             EVENT_READABLE,
             std::bind(
@@ -323,6 +453,103 @@ void Server::onReplyClientAuthDone(int cfd)
 // =========================== auth end
 
 
+// =========================== passthrough start
+void Server::registerSession(int cfd)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    std::lock_guard<std::mutex> lock(m_acceptor->m_sessionMutex);
+    do
+    {
+        Drbg::local().fill((uint8_t *) &client.sessionToken, sizeof(client.sessionToken));
+    } while (client.sessionToken == 0 || m_acceptor->m_sessions.count(client.sessionToken) > 0);
+    m_acceptor->m_sessions[client.sessionToken] = std::make_pair(this, cfd);
+}
+
+void Server::unregisterSession(int cfd)
+{
+    auto it = m_mapClients.find(cfd);
+    if (it == m_mapClients.end() || it->second.sessionToken == 0)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_acceptor->m_sessionMutex);
+    m_acceptor->m_sessions.erase(it->second.sessionToken);
+}
+
+void Server::processDataBind(int dfd, const DataBindMsg &msg)
+{
+    // 不再是客户端, 但连接还要用, 不能close
+    m_reactor.removeFileEvent(dfd, EVENT_READABLE | EVENT_WRITABLE);
+    m_mapClients.erase(dfd);
+
+    uint64_t token;
+    memcpy(&token, msg.sessionToken, sizeof(token));
+    Server *owner = nullptr;
+    int cfd = -1;
+    {
+        std::lock_guard<std::mutex> lock(m_acceptor->m_sessionMutex);
+        auto it = m_acceptor->m_sessions.find(token);
+        if (it != m_acceptor->m_sessions.end())
+        {
+            owner = it->second.first;
+            cfd = it->second.second;
+        }
+    }
+    if (owner == nullptr)
+    {
+        printf("data connection with unknown session: %d\n", dfd);
+        m_pLogger->err("data connection with unknown session: %d", dfd);
+        close(dfd);
+        return;
+    }
+
+    int ufd = ntohl(msg.userId);
+    if (owner == this)
+    {
+        bindUserData(cfd, token, ufd, dfd);
+    }
+    else
+    {
+        owner->m_reactor.postTask(std::bind(&Server::bindUserData, owner, cfd, token, ufd, dfd));
+    }
+}
+
+void Server::bindUserData(int cfd, uint64_t token, int ufd, int dfd)
+{
+    // the client may be gone and its fd reused before the task runs
+    auto client = m_mapClients.find(cfd);
+    if (client == m_mapClients.end() || client->second.sessionToken != token
+        || !isClientUser(cfd, ufd) || m_mapUsers[ufd].relay)
+    {
+        printf("data connection for a gone user: %d\n", ufd);
+        m_pLogger->info("data connection for a gone user: %d", ufd);
+        close(dfd);
+        return;
+    }
+
+    UserInfo &user = m_mapUsers[ufd];
+    user.dataFd = dfd;
+    user.relay = std::make_unique<SpliceRelay>(m_reactor, ufd, dfd, std::bind(&Server::deleteUser, this, ufd));
+    if (!user.relay->start())
+    {
+        printf("start splice relay err: %d\n", errno);
+        m_pLogger->err("start splice relay err: %d", errno);
+        deleteUser(ufd);
+    }
+}
+
+void Server::closeUserData(UserInfo &user)
+{
+    user.relay.reset(); // removes the events of both sockets
+    if (user.dataFd != -1)
+    {
+        close(user.dataFd);
+        user.dataFd = -1;
+    }
+}
+// =========================== passthrough end
+
+
 void Server::recvClientProxyPortsProc(int cfd, int mask)
 {
     if (!(mask & EVENT_READABLE))
@@ -330,7 +557,7 @@ void Server::recvClientProxyPortsProc(int cfd, int mask)
         return;
     }
 
-    clientSafeRecv(
+    int ret = clientSafeRecv(
         cfd, 
         std::bind(
             &Server::checkClientProxyPortsResult, 
@@ -339,6 +566,11 @@ void Server::recvClientProxyPortsProc(int cfd, int mask)
             std::placeholders::_2
         )
     );
+    if (ret > 0)
+    {
+        // a record comes in more than one read, edge triggered epoll won't tell the rest again
+        m_reactor.activateFileEvent(cfd, EVENT_READABLE);
+    }
 }
 
 void Server::checkClientProxyPortsResult(int cfd, size_t dataSize)
@@ -346,15 +578,17 @@ void Server::checkClientProxyPortsResult(int cfd, size_t dataSize)
     unsigned short portNum = 0;
 
     // first 2bytes is the port number
-    memcpy(&portNum, m_mapClients[cfd].recvBuf, sizeof(portNum));
+    memcpy(&portNum, m_mapClients[cfd].recvBuf->data, sizeof(portNum));
     if (portNum <= 0)
     {
         deleteClient(cfd);
         return;
     }
 
+    // new clients put the weight of each port after the ports
     size_t portDataSize = portNum * sizeof(unsigned short);
-    if (dataSize != portDataSize + sizeof(portNum))
+    bool hasWeights = dataSize == 2 * portDataSize + sizeof(portNum);
+    if (dataSize != portDataSize + sizeof(portNum) && !hasWeights)
     {
         printf(
             "encrpt ClientProxyPortsResult data len not good! expect: %lu, infact: %lu\n", 
@@ -367,9 +601,18 @@ void Server::checkClientProxyPortsResult(int cfd, size_t dataSize)
     m_mapClients[cfd].remotePorts.resize(portNum);
     memcpy(
         &m_mapClients[cfd].remotePorts[0], 
-        m_mapClients[cfd].recvBuf + sizeof(portNum), 
+        m_mapClients[cfd].recvBuf->data + sizeof(portNum), 
         portDataSize
     );
+    m_mapClients[cfd].remoteWeights.assign(portNum, 1);
+    if (hasWeights)
+    {
+        memcpy(
+            &m_mapClients[cfd].remoteWeights[0],
+            m_mapClients[cfd].recvBuf->data + sizeof(portNum) + portDataSize,
+            portDataSize
+        );
+    }
     initClient(cfd);
 }
 
@@ -378,9 +621,9 @@ void Server::initClient(int fd)
     listenRemotePort(fd);
     updateClientHeartbeat(fd);
 
-    m_reactor.registerFileEvent(fd, EVENT_READABLE,
-                                std::bind(&Server::recvClientDataProc,
-                                          this, std::placeholders::_1, std::placeholders::_2));
+    m_reactor.setFileProc(fd, EVENT_READABLE,
+                          std::bind(&Server::recvClientDataProc,
+                                    this, std::placeholders::_1, std::placeholders::_2));
 }
 
 int Server::listenRemotePort(int cfd)
@@ -408,6 +651,7 @@ int Server::listenRemotePort(int cfd)
         ListenInfo linfo = {0};
         linfo.port = port;
         linfo.clientFd = cfd;
+        linfo.weight = std::min(std::max<unsigned short>(m_mapClients[cfd].remoteWeights[i], 1), MAX_PROXY_WEIGHT);
         m_mapListen[fd] = linfo;
         tnet::non_block(fd);
         m_reactor.registerFileEvent(fd, EVENT_READABLE,
@@ -421,7 +665,12 @@ int Server::listenRemotePort(int cfd)
 
 void Server::userAcceptProc(int fd, int mask)
 {
-    if (mask & EVENT_READABLE)
+    if (!(mask & EVENT_READABLE))
+    {
+        return;
+    }
+
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++)
     {
         char ip[INET_ADDRSTRLEN];
         int port;
@@ -440,78 +689,36 @@ void Server::userAcceptProc(int fd, int mask)
 
         m_mapUsers[connfd].port = m_mapListen[fd].port;
         m_mapUsers[connfd].cfd = m_mapListen[fd].clientFd;
+        m_mapUsers[connfd].weight = m_mapListen[fd].weight;
+        if (m_mapClients[m_mapListen[fd].clientFd].frameVersion < FRAME_VERSION_VARINT)
+        {
+            m_mapUsers[connfd].sendWindow = UNLIMITED_STREAM_WINDOW;
+        }
 
         tnet::non_block(connfd);
 
-        m_reactor.registerFileEvent(
-            connfd,
-            EVENT_READABLE,
-            std::bind(
-                &Server::userReadDataProc,
-                this,
-                std::placeholders::_1,
-                std::placeholders::_2
-            )
-        );
+        // passthrough users are read by their relay once the data connection is there
+        if (m_mapClients[m_mapListen[fd].clientFd].dataMode == DATA_MODE_TUNNEL && isUserReadable(connfd))
+        {
+            registerUserRead(connfd);
+        }
         sendClientNewProxy(m_mapListen[fd].clientFd, connfd, m_mapListen[fd].port);
     }
+    m_reactor.activateFileEvent(fd, EVENT_READABLE);
 }
 
 void Server::sendClientNewProxy(int cfd, int ufd, unsigned short remotePort)
 {
-    MsgData msgData = {0};
     NewProxyMsg newProxyMsg = {0};
 
     newProxyMsg.userId = ufd;
     newProxyMsg.remotePort = remotePort;
 
-    msgData.type = MSGTYPE_NEW_PROXY;
-    msgData.size = sizeof(newProxyMsg);
-    size_t bufSize = sizeof(msgData) + sizeof(newProxyMsg);
-    char buf[bufSize];
-
-    memcpy(buf, &msgData, sizeof(msgData));
-    memcpy(buf + sizeof(msgData), &newProxyMsg, sizeof(newProxyMsg));
+    char buf[sizeof(newProxyMsg)];
+    size_t bufSize = FrameCodec::encodeNewProxy(m_mapClients[cfd].frameVersion, newProxyMsg, buf);
 
     printf("##### ufd: %d\n", ufd);
-    m_mapClients[cfd].sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-            (uint8_t *) buf,
-            bufSize
-    );
-
-    m_reactor.registerFileEvent(
-        cfd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Server::sendClientNewProxyProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
-}
-
-void Server::sendClientNewProxyProc(int cfd, int mask)
-{
-    if (!(mask & EVENT_WRITABLE))
-    {
-        return;
-    }
-
-    clientSafeSend(
-            cfd,
-            std::bind(
-                    &Server::onSendClientNewProxyDone,
-                    this, std::placeholders::_1
-            )
-    );
-}
-
-void Server::onSendClientNewProxyDone(int cfd)
-{
-    m_reactor.removeFileEvent(cfd, EVENT_WRITABLE);
+    addClientFrame(cfd, MSGTYPE_NEW_PROXY, 0, buf, bufSize);
 }
 
 void Server::recvClientDataProc(int cfd, int mask)
@@ -521,183 +728,197 @@ void Server::recvClientDataProc(int cfd, int mask)
         return;
     }
 
-    clientSafeRecv(
-        cfd, 
-        std::bind(
-            &Server::processClientBuf, 
-            this, 
-            std::placeholders::_1, 
-            std::placeholders::_2
-        )
+    auto callback = std::bind(
+        &Server::processClientBuf, 
+        this, 
+        std::placeholders::_1, 
+        std::placeholders::_2
     );
-}
-
-void Server::processClientBuf(int cfd, size_t dataSize)
-{
-    MsgData msgData;
 
-    memcpy(&msgData, m_mapClients[cfd].recvBuf, sizeof(MsgData));
-
-    if (msgData.type == MSGTYPE_HEARTBEAT)
+    // read records until EAGAIN, go on in next loop if the budget is used up
+    size_t budget = 0;
+    int ret = 0;
+    while (budget < READ_BUDGET_PER_EVENT)
     {
-        if (memcmp(m_mapClients[cfd].recvBuf + sizeof(MsgData), 
-                    HEARTBEAT_CLIENT_MSG, msgData.size) == 0)
+        ret = clientSafeRecv(cfd, callback);
+        if (ret <= 0)
         {
-            updateClientHeartbeat(cfd);
-            sendHeartbeat(cfd);
+            break;
         }
+        budget += ret;
     }
-    else if (msgData.type == MSGTYPE_REPLY_NEW_PROXY)
-    {
-        ReplyNewProxyMsg rnpm = {false};
-        memcpy(&rnpm, m_mapClients[cfd].recvBuf + sizeof(MsgData), msgData.size);
 
-        processNewProxy(rnpm, msgData.userId);
+    if (ret > 0 && m_mapClients.find(cfd) != m_mapClients.end())
+    {
+        m_reactor.activateFileEvent(cfd, EVENT_READABLE);
     }
-    else if (msgData.type == MSGTYPE_CLIENT_APP_DATA)
+}
+
+void Server::processClientBuf(int cfd, size_t dataSize)
+{
+    // a record carries one or more messages. the users its data goes to keep a
+    // reference of it instead of a copy, the next record is received into a new chunk
+    SharedChunk record(std::move(m_mapClients[cfd].recvBuf));
+    uint8_t version = m_mapClients[cfd].frameVersion;
+    size_t offset = 0;
+    while (offset < dataSize)
     {
-        int ufd = msgData.userId;
-        if (m_mapUsers[ufd].isSendBufFull())
+        Frame frame;
+        size_t frameSize;
+        if (!FrameCodec::decode(version, record->data + offset, dataSize - offset, &frame, &frameSize))
         {
-            tellClientUserDown(ufd);
-            deleteUser(ufd);
-            m_pLogger->err("user: %d send buf is full!", ufd);
+            printf("bad message in record from client: %d\n", cfd);
+            m_pLogger->err("bad message in record from client: %d", cfd);
+            deleteClient(cfd);
             return;
         }
 
-        memcpy(
-            m_mapUsers[ufd].currSendBufAddr(),
-            m_mapClients[cfd].recvBuf + sizeof(MsgData),
-            msgData.size
-        );
-        m_mapUsers[ufd].sendSize += msgData.size;
-
-        // duplicated register is ok
-        m_reactor.registerFileEvent(
-            ufd,
-            EVENT_WRITABLE,
-            std::bind(
-                &Server::userWriteDataProc,
-                this,
-                std::placeholders::_1,
-                std::placeholders::_2
-            )
-        );
+        // messages of unknown types are skipped, so are those of users closed here while they were on the way
+        frame.record = &record;
+        bool isStreamGone = MsgUtil::isStreamMsg(frame.type) && !isClientUser(cfd, frame.streamId);
+        if (!isStreamGone && frame.type > 0 && frame.type < MSGTYPE_COUNT
+            && s_clientFrameHandlers[frame.type] != nullptr)
+        {
+            (this->*s_clientFrameHandlers[frame.type])(cfd, frame);
+            if (m_mapClients.find(cfd) == m_mapClients.end())
+            {
+                return; // the message may delete the client
+            }
+        }
+        offset += frameSize;
     }
-    else if (msgData.type == MSGTYPE_LOCAL_DOWN)
+}
+
+// the messages a client may send, by MSGTYPE
+const Server::ClientFrameHandler Server::s_clientFrameHandlers[MSGTYPE_COUNT] = {
+    nullptr,
+    &Server::onHeartbeatFrame,       // MSGTYPE_HEARTBEAT
+    nullptr,                         // MSGTYPE_NEW_PROXY
+    &Server::onReplyNewProxyFrame,   // MSGTYPE_REPLY_NEW_PROXY
+    &Server::onAppDataFrame,         // MSGTYPE_CLIENT_APP_DATA
+    &Server::onLocalDownFrame,       // MSGTYPE_LOCAL_DOWN
+    nullptr,                         // MSGTYPE_USER_DOWN
+    &Server::onWindowUpdateFrame,    // MSGTYPE_WINDOW_UPDATE
+};
+
+void Server::onHeartbeatFrame(int cfd, const Frame &frame)
+{
+    if (frame.size == strlen(HEARTBEAT_CLIENT_MSG)
+        && memcmp(frame.data, HEARTBEAT_CLIENT_MSG, frame.size) == 0)
     {
-        deleteUser(msgData.userId);
+        updateClientHeartbeat(cfd);
+        sendHeartbeat(cfd);
     }
 }
 
-void Server::tellClientUserDown(int ufd)
+void Server::onReplyNewProxyFrame(int cfd, const Frame &frame)
 {
-    int cfd = m_mapUsers[ufd].cfd;
-
-    MsgData msgData;
-    msgData.type = MSGTYPE_USER_DOWN;
-    msgData.userId = ufd;
-    msgData.size = 0;
-
-    m_mapClients[cfd].sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-            (uint8_t *) &msgData,
-            sizeof(msgData)
-    );
-
-    m_reactor.registerFileEvent(
-        cfd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Server::tellClientUserDownProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
+    ReplyNewProxyMsg rnpm = {false};
+    if (FrameCodec::decodeReplyNewProxy(frame, &rnpm))
+    {
+        processNewProxy(rnpm, frame.streamId);
+    }
 }
 
-void Server::tellClientUserDownProc(int cfd, int mask)
+void Server::onAppDataFrame(int cfd, const Frame &frame)
 {
-    if (!(mask & EVENT_WRITABLE))
+    int ufd = frame.streamId;
+    // only when the client ignores the window of this user
+    if (m_mapUsers[ufd].isSendBufFull())
     {
+        tellClientUserDown(ufd);
+        deleteUser(ufd);
+        m_pLogger->err("user: %d send buf is full!", ufd);
         return;
     }
 
-    clientSafeSend(
-            cfd,
-            std::bind(
-                    &Server::onTellClientUserDownDone,
-                    this,
-                    std::placeholders::_1
-            )
-    );
+    bool isQueueEmpty = m_mapUsers[ufd].sendBuf.empty();
+    m_mapUsers[ufd].sendBuf.append(*frame.record, frame.data, frame.size);
+
+    // the frames of all the records of this loop go to the user in one sendmsg at its end,
+    // a queue not empty before is flushed then already or waits for the writable event
+    if (isQueueEmpty)
+    {
+        markUserDirty(ufd);
+    }
 }
 
-void Server::onTellClientUserDownDone(int cfd)
+void Server::onLocalDownFrame(int cfd, const Frame &frame)
 {
-    m_reactor.removeFileEvent(cfd, EVENT_WRITABLE);
-    printf("onTellClientUserDownDone\n");
+    deleteUser(frame.streamId);
 }
 
-void Server::sendHeartbeat(int cfd)
+void Server::onWindowUpdateFrame(int cfd, const Frame &frame)
 {
-    if (m_mapClients[cfd].isSendBufFull())
+    WindowUpdateMsg wum = {0};
+    if (FrameCodec::decodeWindowUpdate(frame, &wum))
     {
-        m_pLogger->err("client: %d send buf is full, can't send heartbeat", cfd);
-        return;
+        processWindowUpdate(frame.streamId, wum);
     }
+}
 
-    MsgData heartData;
-    heartData.type = MSGTYPE_HEARTBEAT;
-    heartData.size = strlen(HEARTBEAT_SERVER_MSG);
+void Server::processWindowUpdate(int ufd, const WindowUpdateMsg &wum)
+{
+    auto it = m_mapUsers.find(ufd);
+    if (it == m_mapUsers.end())
+    {
+        return; // the user is gone already
+    }
+    UserInfo &user = it->second;
+    if (user.sendWindow == UNLIMITED_STREAM_WINDOW)
+    {
+        return;
+    }
+    // the client gives back at most what it got, more would wrap the window
+    if (wum.increment > DEFAULT_STREAM_WINDOW - user.sendWindow)
+    {
+        printf("processWindowUpdate: increment %u over the window of user %d\n", wum.increment, ufd);
+        m_pLogger->err("processWindowUpdate: increment %u over the window of user %d", wum.increment, ufd);
+        user.sendWindow = DEFAULT_STREAM_WINDOW;
+    }
+    else
+    {
+        user.sendWindow += wum.increment;
+    }
+    if (isUserReadable(ufd))
+    {
+        registerUserRead(ufd);
+    }
+}
 
-    size_t dataSize = sizeof(heartData) + strlen(HEARTBEAT_SERVER_MSG);
-    char bufData[dataSize];
+void Server::sendClientWindowUpdate(int ufd)
+{
+    int cfd = m_mapUsers[ufd].cfd;
 
-    memcpy(bufData, &heartData, sizeof(heartData));
-    memcpy(bufData + sizeof(heartData), HEARTBEAT_SERVER_MSG, strlen(HEARTBEAT_SERVER_MSG));
+    WindowUpdateMsg wum = {0};
+    wum.increment = m_mapUsers[ufd].sentToUser;
+    m_mapUsers[ufd].sentToUser = 0;
+    if (m_mapClients[cfd].frameVersion < FRAME_VERSION_VARINT)
+    {
+        return; // 旧客户端不限制窗口
+    }
 
-    m_mapClients[cfd].sendSize += MsgUtil::packEncryptedData(
-            m_pCryptor,
-            (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-            (uint8_t *) bufData,
-            dataSize
-    );
+    char buf[sizeof(wum)];
+    size_t bufSize = FrameCodec::encodeWindowUpdate(m_mapClients[cfd].frameVersion, wum, buf);
+    addClientFrame(cfd, MSGTYPE_WINDOW_UPDATE, ufd, buf, bufSize);
+}
 
-    m_reactor.registerFileEvent(
-        cfd,
-        EVENT_WRITABLE,
-        std::bind(
-            &Server::writeHeartbeatDataProc,
-            this,
-            std::placeholders::_1,
-            std::placeholders::_2
-        )
-    );
+void Server::tellClientUserDown(int ufd)
+{
+    int cfd = m_mapUsers[ufd].cfd;
+
+    addClientFrame(cfd, MSGTYPE_USER_DOWN, ufd, nullptr, 0);
 }
 
-void Server::writeHeartbeatDataProc(int cfd, int mask)
+void Server::sendHeartbeat(int cfd)
 {
-    if (!(mask & EVENT_WRITABLE))
+    if (m_mapClients[cfd].isSendBufFull())
     {
+        m_pLogger->err("client: %d send buf is full, can't send heartbeat", cfd);
         return;
     }
 
-    clientSafeSend(
-            cfd,
-            std::bind(
-                    &Server::onWriteHeartbeatDataDone,
-                    this,
-                    std::placeholders::_1
-            )
-    );
-}
-
-void Server::onWriteHeartbeatDataDone(int cfd)
-{
-    m_reactor.removeFileEvent(cfd, EVENT_WRITABLE);
+    addClientFrame(cfd, MSGTYPE_HEARTBEAT, 0, HEARTBEAT_SERVER_MSG, strlen(HEARTBEAT_SERVER_MSG));
 }
 
 void Server::updateClientHeartbeat(int cfd)
@@ -758,33 +979,88 @@ void Server::processNewProxy(const ReplyNewProxyMsg &rnpm, int uid)
 void Server::userWriteDataProc(int fd, int mask)
 {
     printf("on userWriteDataProc\n");
-    auto numSend = send(fd, m_mapUsers[fd].sendBuf, m_mapUsers[fd].sendSize, MSG_DONTWAIT);
-    if (numSend > 0)
+    UserInfo &user = m_mapUsers[fd];
+    while (!user.sendBuf.empty())
     {
-        if (static_cast<size_t>(numSend) == m_mapUsers[fd].sendSize)
+        struct iovec iov[MAX_WRITE_IOVS];
+        size_t len;
+        int iovCnt = user.sendBuf.peek(iov, MAX_WRITE_IOVS, &len);
+        auto numSend = tnet::send_iov(fd, iov, iovCnt);
+        if (numSend == -1)
         {
-            m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
-            // 缓冲区已经全部发送了，从开始放数据
-            m_mapUsers[fd].sendSize = 0;
-            printf("userWriteDataProc: send all data: %ld\n", numSend);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("userWriteDataProc send err:%d\n", errno);
+                m_pLogger->err("userWriteDataProc send err:%d", errno);
+            }
+            return;
         }
-        else
+
+        // the buffer has room again, give the credit back to the client
+        user.sendBuf.consume(numSend);
+        user.sentToUser += numSend;
+        if (user.sentToUser >= WINDOW_UPDATE_THRESHOLD)
         {
-            // 没有全部发送完，把没发送的数据移动到前面
-            size_t newSize = m_mapUsers[fd].sendSize - numSend; // 还剩多少没发送完
-            m_mapUsers[fd].sendSize = newSize;
-            memmove(m_mapUsers[fd].sendBuf, m_mapUsers[fd].sendBuf + numSend, newSize);
-            printf("userWriteDataProc: send partial data: %ld, left:%lu\n", numSend, newSize);
+            sendClientWindowUpdate(fd);
         }
-    }
-    else
-    {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+
+        if (static_cast<size_t>(numSend) < len)
         {
-            printf("userWriteDataProc send err:%d\n", errno);
-            m_pLogger->err("userWriteDataProc send err:%d", errno);
+            // 没有全部发送完，剩下的等下次可写
+            printf("userWriteDataProc: send partial data: %ld, left:%lu\n", numSend, user.sendBuf.size());
+            return;
         }
     }
+
+    // 缓冲区已经全部发送了
+    m_reactor.removeFileEvent(fd, EVENT_WRITABLE);
+    printf("userWriteDataProc: send all data\n");
+}
+
+void Server::sendUserAsync(int ufd)
+{
+    UserInfo &user = m_mapUsers[ufd];
+    if (user.inFlight > 0 || user.sendBuf.empty())
+    {
+        return; // the rest goes when the send in flight is done
+    }
+
+    ChainBuffer buf;
+    buf.append(std::move(user.sendBuf));
+    user.inFlight = buf.size();
+    m_reactor.submitSend(
+        ufd,
+        std::move(buf),
+        std::bind(
+            &Server::onUserSendDone,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
+}
+
+void Server::onUserSendDone(int ufd, ssize_t res)
+{
+    UserInfo &user = m_mapUsers[ufd];
+    if (res < 0)
+    {
+        printf("userWriteDataProc send err:%ld\n", -res);
+        m_pLogger->err("userWriteDataProc send err:%ld", -res);
+        user.inFlight = 0;
+        tellClientUserDown(ufd);
+        deleteUser(ufd);
+        return;
+    }
+
+    // the user took them, give the credit back to the client
+    user.inFlight -= std::min(user.inFlight, static_cast<size_t>(res));
+    user.sentToUser += res;
+    if (user.sentToUser >= WINDOW_UPDATE_THRESHOLD)
+    {
+        sendClientWindowUpdate(ufd);
+    }
+    sendUserAsync(ufd);
 }
 
 /*
@@ -795,56 +1071,126 @@ void Server::userReadDataProc(int ufd, int mask)
 {
     printf("on userReadDataProc\n");
 
-    auto cfd = m_mapUsers[ufd].cfd;
-    auto recvOffset = m_mapClients[cfd].sendSize + sizeof(MsgData);
-    if (recvOffset >= MAX_BUF_SIZE)
+    // the data waits in the socket until the user gets its turn
+    m_reactor.removeFileEvent(ufd, EVENT_READABLE);
+
+    UserInfo &user = m_mapUsers[ufd];
+    if (!user.isActive)
     {
-        printf("proxy send buf full\n");
-        return;
+        user.isActive = true;
+        m_mapClients[user.cfd].activeUsers.push_back(ufd);
     }
 
-    int numRecv = recv(ufd, m_mapClients[cfd].sendBuf + recvOffset,
-                       MAX_BUF_SIZE - recvOffset, MSG_DONTWAIT);
-    if (numRecv == -1)
+    // the turns are taken when the tunnel is writable, at the end of this loop if it was not full,
+    // so all the users readable in this loop are in the round before the first one is read
+    markClientDirty(user.cfd);
+}
+
+/*
+ * deficit round robin over the users of a client with data waiting, a turn reads
+ * up to weight * DRR_QUANTUM bytes of a user right into the open record.
+ * the tunnel takes them only below the high water mark, so a bulk user can't queue
+ * much in front of an interactive one. returns the bytes read
+ */
+size_t Server::scheduleUserReads(int cfd, size_t budget)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    size_t numRead = 0;
+    while (!client.activeUsers.empty() && !client.isAboveHighWater() && numRead < budget)
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        int ufd = client.activeUsers.front();
+        client.activeUsers.pop_front();
+        UserInfo &user = m_mapUsers[ufd];
+        user.deficit += DRR_QUANTUM * user.weight;
+
+        bool isDrained = false;
+        bool isClosed = false;
+        while (user.deficit > 0 && user.sendWindow > 0)
         {
-            printf("userReadDataProc recv err: %d\n", errno);
-            m_pLogger->err("userReadDataProc recv err: %d\n", errno);
-            return;
+            size_t room;
+            char *payload = client.batcher.prepare(clientCryptor(cfd), client.sendQueue, MSGTYPE_CLIENT_APP_DATA, ufd,
+                                                   MIN_RECORD_ROOM, &room);
+            size_t recvSize = std::min({room, user.deficit, static_cast<size_t>(user.sendWindow)});
+            int numRecv = recv(ufd, payload, recvSize, MSG_DONTWAIT);
+            if (numRecv == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    printf("userReadDataProc recv err: %d\n", errno);
+                    m_pLogger->err("userReadDataProc recv err: %d\n", errno);
+                }
+                isDrained = true;
+                break;
+            }
+            else if (numRecv == 0)
+            {
+                isClosed = true;
+                break;
+            }
+
+            if (user.sendWindow != UNLIMITED_STREAM_WINDOW)
+            {
+                user.sendWindow -= numRecv;
+            }
+            user.deficit -= numRecv;
+            numRead += numRecv;
+            client.batcher.commit(clientCryptor(cfd), client.sendQueue, numRecv);
+            printf("userReadDataProc: recv from user: %d, client snedSize: %lu\n", numRecv, client.pendingSize());
+
+            // a short read means the socket is drained
+            if (static_cast<size_t>(numRecv) < recvSize)
+            {
+                isDrained = true;
+                break;
+            }
+        }
+
+        if (isClosed || isDrained || user.sendWindow == 0)
+        {
+            // out of the round, back when it is readable again or the client gives window
+            user.isActive = false;
+            user.deficit = 0;
+            if (isClosed)
+            {
+                deleteUser(ufd);
+            }
+            else if (isUserReadable(ufd))
+            {
+                registerUserRead(ufd);
+            }
+        }
+        else
+        {
+            client.activeUsers.push_back(ufd); // more to read, wait for the next round
         }
     }
-    else if (numRecv == 0)
-    {
-        deleteUser(ufd);
-    }
-    else if (numRecv > 0)
-    {
-        MsgData msgData;
-        msgData.type = MSGTYPE_CLIENT_APP_DATA;
-        msgData.size = numRecv;
-        msgData.userId = ufd;
-        memcpy(m_mapClients[cfd].currSendBufAddr(), &msgData, sizeof(msgData));
+    return numRead;
+}
 
-        m_mapClients[cfd].sendSize += MsgUtil::packEncryptedData(
-                m_pCryptor,
-                (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-                (uint8_t *) m_mapClients[cfd].currSendBufAddr(),
-                numRecv + sizeof(msgData)
-        );
+bool Server::isClientUser(int cfd, int ufd)
+{
+    auto it = m_mapUsers.find(ufd);
+    return it != m_mapUsers.end() && it->second.cfd == cfd;
+}
 
-        m_reactor.registerFileEvent(
-            cfd,
-            EVENT_WRITABLE,
-            std::bind(
-                &Server::sendUserDataProc,
-                this,
-                std::placeholders::_1,
-                std::placeholders::_2
-            )
-        );
-        printf("userReadDataProc: recv from user: %d, client snedSize: %lu\n", numRecv, m_mapClients[cfd].sendSize);
-    }
+bool Server::isUserReadable(int ufd)
+{
+    const UserInfo &user = m_mapUsers[ufd];
+    return !user.isActive && user.sendWindow > 0;
+}
+
+void Server::registerUserRead(int ufd)
+{
+    m_reactor.registerFileEvent(
+        ufd,
+        EVENT_READABLE,
+        std::bind(
+            &Server::userReadDataProc,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
 }
 
 void Server::sendUserDataProc(int fd, int mask)
@@ -874,7 +1220,23 @@ void Server::onSendUserDataDone(int fd)
 
 void Server::deleteUser(int fd)
 {
+    auto it = m_mapUsers.find(fd);
+    if (it != m_mapUsers.end() && it->second.isActive)
+    {
+        // out of the round of its client
+        auto client = m_mapClients.find(it->second.cfd);
+        if (client != m_mapClients.end())
+        {
+            std::deque<int> &activeUsers = client->second.activeUsers;
+            activeUsers.erase(std::remove(activeUsers.begin(), activeUsers.end(), fd), activeUsers.end());
+        }
+    }
+    if (it != m_mapUsers.end())
+    {
+        closeUserData(it->second);
+    }
     m_mapUsers.erase(fd);
+    m_reactor.cancelSend(fd);
     close(fd);
     m_reactor.removeFileEvent(fd, EVENT_WRITABLE | EVENT_READABLE);
     printf("deleted user:%d\n", fd);
@@ -886,7 +1248,9 @@ void Server::deleteClient(int fd)
     printf("client gone!\n");
     m_pLogger->info("client gone!");
     m_reactor.removeFileEvent(fd, EVENT_READABLE | EVENT_WRITABLE);
+    unregisterSession(fd);
     m_mapClients.erase(fd);
+    m_reactor.cancelSend(fd);
     close(fd);
     // 需要加快效率，不应每次遍历,注意删除顺序,user -> remotelisten
     // 删除相关的user
@@ -896,7 +1260,9 @@ void Server::deleteClient(int fd)
         if (cfd == fd)
         {
             int ufd = it->first;
+            closeUserData(it->second);
             m_reactor.removeFileEvent(ufd, EVENT_READABLE | EVENT_WRITABLE);
+            m_reactor.cancelSend(ufd);
             close(ufd);
             it = m_mapUsers.erase(it);
             printf("delete user conn with this client! %d\n", ufd);
@@ -947,11 +1313,262 @@ void Server::setPassword(const char *password)
 
     strncpy(m_serverPassword, MD5(password).toStr().c_str(), sizeof(m_serverPassword)); // md5加密
 
+    initCryptors();
+}
+
+void Server::initCryptors()
+{
     m_pCryptor = std::make_unique<Cryptor>(CRYPT_CBC, (uint8_t*)m_serverPassword);
+    if (Cryptor::isSupported(CRYPT_GCM))
+    {
+        m_pGcmCryptor = std::make_unique<Cryptor>(CRYPT_GCM, (uint8_t*)m_serverPassword);
+    }
+    m_pChachaCryptor = std::make_unique<Cryptor>(CRYPT_CHACHA20_POLY1305, (uint8_t*)m_serverPassword);
+}
+
+/*
+ * gcm when both cpus have AES-NI, chacha20-poly1305 is faster than aes without it.
+ * old clients offer nothing and keep cbc
+ */
+CRYPT_METHOD Server::chooseCryptMethod(uint8_t clientMethods)
+{
+    if ((clientMethods & (1 << CRYPT_GCM)) && m_pGcmCryptor)
+    {
+        return CRYPT_GCM;
+    }
+    if (clientMethods & (1 << CRYPT_CHACHA20_POLY1305))
+    {
+        return CRYPT_CHACHA20_POLY1305;
+    }
+    return CRYPT_CBC;
+}
+
+const std::unique_ptr<Cryptor> &Server::clientCryptor(int cfd)
+{
+    switch (m_mapClients[cfd].cryptMethod)
+    {
+    case CRYPT_GCM:
+        return m_pGcmCryptor;
+    case CRYPT_CHACHA20_POLY1305:
+        return m_pChachaCryptor;
+    default:
+        return m_pCryptor;
+    }
+}
+
+void Server::addClientFrame(int cfd, int type, uint32_t streamId, const void *data, size_t size)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    FrameBatcher &batcher = MsgUtil::isControlMsg(type) ? client.ctrlBatcher : client.batcher;
+    batcher.add(clientCryptor(cfd), client.sendQueue, type, streamId, data, size);
+    markClientDirty(cfd);
+}
+
+void Server::sealClientRecord(int cfd)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    client.ctrlBatcher.seal(clientCryptor(cfd), client.sendQueue);
+    client.batcher.seal(clientCryptor(cfd), client.sendQueue);
+}
+
+/*
+ * send what the client has pending now instead of in next loop. the writable event
+ * is kept only when the socket doesn't take it all, and the reactor makes no syscall
+ * for an event registered and removed in the same loop
+ */
+void Server::flushClient(int cfd)
+{
+    if (m_reactor.canSubmitSend())
+    {
+        sendClientAsync(cfd);
+        return;
+    }
+    m_reactor.registerFileEvent(
+        cfd,
+        EVENT_WRITABLE,
+        std::bind(
+            &Server::sendUserDataProc,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
+    if (!m_mapClients[cfd].isSocketFull)
+    {
+        sendUserDataProc(cfd, EVENT_WRITABLE);
+    }
+}
+
+/*
+ * the users take their turns like in clientSafeSend, and the whole queue is handed to the
+ * kernel, no writable event and no EAGAIN. one send in flight, what is queued meanwhile goes
+ * when it is done. the bytes in flight count for the high water mark, so a slow client
+ * still stops the reads
+ */
+void Server::sendClientAsync(int cfd)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    scheduleUserReads(cfd, READ_BUDGET_PER_EVENT);
+    sealClientRecord(cfd);
+    if (client.inFlight > 0 || client.sendQueue.empty())
+    {
+        return;
+    }
+
+    ChainBuffer buf;
+    client.sendQueue.takeAll(buf);
+    client.inFlight = buf.size();
+    m_reactor.submitSend(
+        cfd,
+        std::move(buf),
+        std::bind(
+            &Server::onClientSendDone,
+            this,
+            std::placeholders::_1,
+            std::placeholders::_2
+        )
+    );
+}
+
+void Server::onClientSendDone(int cfd, ssize_t res)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    if (res < 0)
+    {
+        printf("clientSafeSend err: %ld\n", -res);
+        m_pLogger->err("clientSafeSend err: %ld\n", -res);
+        deleteClient(cfd);
+        return;
+    }
+
+    // the room taken back lets the users waiting for their turn read again
+    client.inFlight -= std::min(client.inFlight, static_cast<size_t>(res));
+    if (client.inFlight == 0 || !client.activeUsers.empty())
+    {
+        markClientDirty(cfd);
+    }
+}
+
+void Server::markClientDirty(int cfd)
+{
+    ClientInfo &client = m_mapClients[cfd];
+    if (!client.isDirty)
+    {
+        client.isDirty = true;
+        m_dirtyClients.push_back(cfd);
+    }
+}
+
+void Server::markUserDirty(int ufd)
+{
+    UserInfo &user = m_mapUsers[ufd];
+    if (!user.isDirty)
+    {
+        user.isDirty = true;
+        m_dirtyUsers.push_back(ufd);
+    }
+}
+
+/*
+ * the procs of a loop only queue what they send, every connection with something new
+ * is flushed here once: the frames of the loop go to a client in as few records and
+ * sendmsg calls as they fit, and its writable event is touched once.
+ * the users go first, the window updates of their writes go out with the clients.
+ * a fd closed and reused in the loop is skipped, the flag of the new one is not set
+ */
+void Server::flushDirtyConns()
+{
+    for (size_t i = 0; i < m_dirtyUsers.size(); i++)
+    {
+        int ufd = m_dirtyUsers[i];
+        auto it = m_mapUsers.find(ufd);
+        if (it == m_mapUsers.end() || !it->second.isDirty)
+        {
+            continue;
+        }
+        it->second.isDirty = false;
+        if (m_reactor.canSubmitSend())
+        {
+            sendUserAsync(ufd);
+            continue;
+        }
+        m_reactor.registerFileEvent(
+            ufd,
+            EVENT_WRITABLE,
+            std::bind(
+                &Server::userWriteDataProc,
+                this,
+                std::placeholders::_1,
+                std::placeholders::_2
+            )
+        );
+        userWriteDataProc(ufd, EVENT_WRITABLE);
+    }
+    m_dirtyUsers.clear();
+
+    for (size_t i = 0; i < m_dirtyClients.size(); i++)
+    {
+        int cfd = m_dirtyClients[i];
+        auto it = m_mapClients.find(cfd);
+        if (it == m_mapClients.end() || !it->second.isDirty)
+        {
+            continue;
+        }
+        it->second.isDirty = false;
+        flushClient(cfd);
+    }
+    m_dirtyClients.clear();
+}
+
+void Server::setThreadNum(size_t num)
+{
+    m_threadNum = num > 0 ? num : 1;
+}
+
+void Server::setPassthrough(bool isPassthrough)
+{
+    if (isPassthrough && !SpliceRelay::isSupported())
+    {
+        printf("cipher = none needs splice, user data stays in the tunnel\n");
+        m_pLogger->err("cipher = none needs splice, user data stays in the tunnel");
+        isPassthrough = false;
+    }
+    m_isPassthrough = isPassthrough;
+}
+
+void Server::startWorkers()
+{
+    for (size_t i = 1; i < m_threadNum; i++)
+    {
+        m_workers.emplace_back(new Server(m_pLogger, this));
+    }
+    for (auto &worker : m_workers)
+    {
+        m_workerThreads.emplace_back(&Server::startEventLoop, worker.get());
+    }
+}
+
+void Server::stopWorkers()
+{
+    for (auto &worker : m_workers)
+    {
+        Server *w = worker.get();
+        w->m_reactor.postTask([w]() { w->m_reactor.stopEventLoop(); });
+    }
+    for (auto &t : m_workerThreads)
+    {
+        t.join();
+    }
+    m_workerThreads.clear();
+    m_workers.clear();
 }
 
 void Server::startEventLoop()
 {
-    m_pLogger->info("server running...");
+    if (!m_isWorker)
+    {
+        startWorkers();
+        m_pLogger->info("server running with %lu reactor threads...", m_threadNum);
+    }
     m_reactor.eventLoop(EVENT_LOOP_FILE_EVENT | EVENT_LOOP_TIMER_EVENT);
 }
\ No newline at end of file
@@ -2,15 +2,21 @@
 #define __SERVER_H__
 
 #include <cstdio>
+#include <deque>
 #include <unordered_map>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "../msg/msgdata.h"
 #include "../msg/cryptor.h"
+#include "../msg/batcher.h"
+#include "../msg/codec.h"
 
 #include "../net/tnet.h"
 #include "../net/reactor.h"
+#include "../net/splice_relay.h"
 #include "../third_part/logger.h"
 
 
@@ -18,6 +24,7 @@ const unsigned short DEFAULT_PORT = 10086;
 
 const int HEARTBEAT_INTERVAL_MS = 1000;      // 每次心跳的间隔时间
 const long DEFAULT_SERVER_TIMEOUT_MS = 5000; // 默认5秒没收到服务端的心跳表示服务端不在
+const int MAX_ACCEPTS_PER_EVENT = 64;        // 每次唤醒最多accept的连接数
 
 
 enum ClientStatus
@@ -33,30 +40,40 @@ struct ClientInfo
   DataHeader header;
 
   size_t recvNum{0};
-  char recvBuf[MAX_BUF_SIZE + AES_BLOCKLEN];  // AES_BLOCKLEN is for aes padding size
+  ChunkPtr recvBuf;     // 一个记录最多一个chunk，接收时从池里取，空闲时还回去
   
-  size_t sendSize{0};
-  char sendBuf[MAX_BUF_SIZE + AES_BLOCKLEN];
+  RecordQueue sendQueue; // 控制记录排在没开始发的数据记录前面
+  FrameBatcher ctrlBatcher{LANE_CONTROL}; // 心跳, 新代理, 窗口更新
+  FrameBatcher batcher; // 认证之后的消息先攒在这里, 发送前封成一个记录放进sendQueue
 
   ClientStatus status{CLIENT_STATUS_CONNECTED};
+  CRYPT_METHOD cryptMethod{CRYPT_CBC}; // 认证时协商的之后记录的加密方式
+  uint8_t frameVersion{FRAME_VERSION_FIXED}; // 认证时协商的消息编码
+  DATA_MODE dataMode{DATA_MODE_TUNNEL};       // 认证时协商的用户数据走法
+  uint64_t sessionToken{0};                   // DATA_MODE_SPLICE时数据连接带着它来, 见bindUserData
+  std::deque<int> activeUsers; // users with data waiting for their turn, see scheduleUserReads
+  bool isSocketFull{false}; // 上次没发完, 等可写事件
+  bool isDirty{false};      // 这次循环里加了消息, 在m_dirtyClients里
+  size_t inFlight{0};       // io_uring: 交给内核还没发完的, 见sendClientAsync
   
   long long lastHeartbeat{-1}; // 上次收到心跳的时间戳，如果是-1，表示还没初始化客户端，无需检测
 
   std::vector<unsigned short> remotePorts;
+  std::vector<unsigned short> remoteWeights; // 每个端口的权重, 旧客户端不发, 都是1
 
-  bool isSendBufFull()
+  size_t pendingSize() const
   {
-    return sendSize >= MAX_BUF_SIZE;
+    return sendQueue.size() + ctrlBatcher.size() + batcher.size() + inFlight;
   }
 
-  bool isRecvBufFull()
+  bool isSendBufFull()
   {
-    return recvNum >= MAX_BUF_SIZE;
+    return pendingSize() >= MAX_BUF_SIZE;
   }
 
-  char* currSendBufAddr()
+  bool isAboveHighWater()
   {
-    return sendBuf + sendSize;
+    return pendingSize() >= TUNNEL_HIGH_WATER_MARK;
   }
 };
 using ClientInfoMap = std::unordered_map<int, ClientInfo>;
@@ -66,6 +83,7 @@ struct ListenInfo
 {
   unsigned short port; //  监听的对外端口
   int clientFd;        // 属于哪个客户端
+  unsigned short weight; // 这个端口的用户轮流发送时的权重
 };
 using ListenInfoMap = std::unordered_map<int, ListenInfo>;
 
@@ -75,17 +93,23 @@ struct UserInfo
   unsigned short port;
   int cfd;
 
-  size_t sendSize{0}; // 发送缓冲区现有数据
-  char sendBuf[MAX_BUF_SIZE + AES_BLOCKLEN + sizeof(DataHeader)];
+  ChainBuffer sendBuf; // 发送缓冲区现有数据
+  size_t inFlight{0};  // io_uring: 交给内核还没写完的, 见sendUserAsync
 
-  bool isSendBufFull()
-  {
-    return sendSize >= MAX_BUF_SIZE;
-  }
+  uint32_t sendWindow{DEFAULT_STREAM_WINDOW}; // 还可以发给客户端的数据量
+  uint32_t sentToUser{0};                     // 写给user但还没告诉客户端的数据量
+
+  unsigned short weight{1};
+  size_t deficit{0};     // 这一轮还可以读的数据量
+  bool isActive{false};  // 在客户端的activeUsers里
+  bool isDirty{false};   // sendBuf这次循环里从空变成有数据, 在m_dirtyUsers里
 
-  char* currSendBufAddr()
+  int dataFd{-1};                     // DATA_MODE_SPLICE: 客户端为这个用户连过来的数据连接
+  std::unique_ptr<SpliceRelay> relay; // 在user和dataFd之间转发, 不经过隧道
+
+  bool isSendBufFull()
   {
-    return sendBuf + sendSize;
+    return sendBuf.size() + inFlight >= MAX_BUF_SIZE;
   }
 };
 using UserInfoMap = std::unordered_map<int, UserInfo>;
@@ -103,7 +127,9 @@ private:
   char m_serverPassword[PW_MAX_LEN]{};
 
   std::shared_ptr<Logger> m_pLogger;
-  std::unique_ptr<Cryptor> m_pCryptor;
+  std::unique_ptr<Cryptor> m_pCryptor;    // cbc, auth records and old clients
+  std::unique_ptr<Cryptor> m_pGcmCryptor; // nullptr if the cpu can't do gcm
+  std::unique_ptr<Cryptor> m_pChachaCryptor;
 
   long long m_heartbeatTimerId{};
 
@@ -111,13 +137,52 @@ private:
   ListenInfoMap m_mapListen;
   UserInfoMap m_mapUsers;
 
+  // 这次循环里有东西要发的连接, 循环结束时每个只发一次, 见flushDirtyConns
+  std::vector<int> m_dirtyClients;
+  std::vector<int> m_dirtyUsers;
+
+  // multi reactor: this server accepts clients and shares them with the workers,
+  // every worker owns its clients, their listen ports and users, nothing is shared
+  bool m_isWorker{false};
+  size_t m_threadNum{1};
+  size_t m_nextWorker{0};
+  std::vector<std::unique_ptr<Server>> m_workers;
+  std::vector<std::thread> m_workerThreads;
+
+  // cipher = none: 用户数据走单独的明文连接, 数据连接可能被任何一个worker accept,
+  // 所以会话都登记在acceptor里, 见processDataBind
+  bool m_isPassthrough{false};
+  Server *m_acceptor{this};
+  std::mutex m_sessionMutex;
+  std::unordered_map<uint64_t, std::pair<Server *, int>> m_sessions; // token -> 哪个worker的哪个客户端
+
+  Server(std::shared_ptr<Logger> &logger, Server *acceptor); // make a worker of the acceptor
+
   // server init methods
   int listenControl(); // 监听服务器控制端口，负责新客户端接入
   void initServer();
   void serverAcceptProc(int fd, int mask);
+  Server *nextWorker();
+  void addClient(int cfd);
+
+  void startWorkers();
+  void stopWorkers();
+
+  void initCryptors();
+  CRYPT_METHOD chooseCryptMethod(uint8_t clientMethods); // the fastest both sides can do
+  const std::unique_ptr<Cryptor> &clientCryptor(int cfd); // the one negotiated with the client
+  void addClientFrame(int cfd, int type, uint32_t streamId, const void *data, size_t size); // into the open record
+  void sealClientRecord(int cfd);
+  void flushClient(int cfd); // send the pending frames now, the writable event only for the rest
+  void sendClientAsync(int cfd); // flushClient with io_uring, the kernel sends it all by itself
+  void onClientSendDone(int cfd, ssize_t res);
+  void markClientDirty(int cfd); // flush it at the end of this loop
+  void markUserDirty(int ufd);
+  void flushDirtyConns(); // before sleep proc of the reactor
 
   // recv and send
-  void clientSafeRecv(int cfd, const std::function<void(int cfd, size_t dataSize)>& callback);
+  // bytes received, 0 if the client is gone, -1 if there is nothing to read
+  int clientSafeRecv(int cfd, const std::function<void(int cfd, size_t dataSize)>& callback);
   void clientSafeSend(int cfd, const std::function<void(int cfd)>& callback);
 
   // auth methods
@@ -127,22 +192,34 @@ private:
   void replyClientAuthProc(int cfd, int mask);   // 回复认证结果
   void onReplyClientAuthDone(int cfd);  // callback func
 
+  // passthrough data connections
+  void registerSession(int cfd);   // 给客户端一个token, 它的数据连接用来证明身份
+  void unregisterSession(int cfd);
+  void processDataBind(int dfd, const DataBindMsg &msg); // 数据连接交给客户端所在的worker
+  void bindUserData(int cfd, uint64_t token, int ufd, int dfd); // run in the thread of the client
+  void closeUserData(UserInfo &user);
+
   // proxy ports methods
   void checkClientProxyPortsResult(int cfd, size_t dataSize);
   void recvClientProxyPortsProc(int cfd, int mask);
 
   void userAcceptProc(int fd, int mask); // 接收user的连接
   void sendClientNewProxy(int cfd, int ufd, unsigned short port);
-  void sendClientNewProxyProc(int cfd, int mask);   
-  void onSendClientNewProxyDone(int cfd); // callback
 
   void recvClientDataProc(int fd, int mask);   // 正常建立链接后，客户端和服务器交互的数据处理
   void processClientBuf(int cfd,  size_t dataSize);
+
+  // 一个记录里的一条消息, 按类型分发
+  using ClientFrameHandler = void (Server::*)(int cfd, const Frame &frame);
+  static const ClientFrameHandler s_clientFrameHandlers[MSGTYPE_COUNT];
+  void onHeartbeatFrame(int cfd, const Frame &frame);
+  void onReplyNewProxyFrame(int cfd, const Frame &frame);
+  void onAppDataFrame(int cfd, const Frame &frame);
+  void onLocalDownFrame(int cfd, const Frame &frame);
+  void onWindowUpdateFrame(int cfd, const Frame &frame);
   
   // heartbeat
   void sendHeartbeat(int cfd);         // 回复心跳
-  void writeHeartbeatDataProc(int cfd, int mask);
-  void onWriteHeartbeatDataDone(int cfd);
 
   void updateClientHeartbeat(int cfd); // 更新客户端心跳时间
   int checkHeartbeatTimerProc(long long id); // 检查客户端心跳,定时器
@@ -152,14 +229,21 @@ private:
 
   int listenRemotePort(int cfd);                // 监听cfd客户端的远程端口
 
-  void userReadDataProc(int fd, int mask);   // 接收用户发来的数据
+  bool isClientUser(int cfd, int ufd);  // 用户还在并且属于这个客户端
+  bool isUserReadable(int ufd);  // 不在等待轮到它并且流还有窗口
+  void registerUserRead(int ufd);
+  void userReadDataProc(int fd, int mask);   // 用户有数据了, 排队等轮到它
+  size_t scheduleUserReads(int cfd, size_t budget); // 按权重轮流接收用户的数据
   void userWriteDataProc(int fd, int mask);  // 给用户发送的数据
+  void sendUserAsync(int ufd);               // io_uring: 整个发送缓冲区交给内核去发
+  void onUserSendDone(int ufd, ssize_t res);
   void sendUserDataProc(int fd, int mask);  // 把用户发来的数据给客户端发过去
   void onSendUserDataDone(int fd);  // 发送完成时的回调
 
+  void sendClientWindowUpdate(int ufd);
+  void processWindowUpdate(int ufd, const WindowUpdateMsg &wum);
+
   void tellClientUserDown(int ufd);
-  void tellClientUserDownProc(int cfd, int mask);
-  void onTellClientUserDownDone(int cfd);
 
   void initClient(int fd);
   void deleteClient(int fd);
@@ -170,6 +254,8 @@ public:
   ~Server();
 
   void setPassword(const char *password);
+  void setThreadNum(size_t num); // how many reactor threads, call before startEventLoop
+  void setPassthrough(bool isPassthrough); // cipher = none, call before startEventLoop
 
   void startEventLoop();
 };
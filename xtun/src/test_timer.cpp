@@ -2,7 +2,7 @@
 #include <cstdio>
 #include <unistd.h>
 
-TimerPool *tp;
+Timer *tp;
 long long id1,id2;
 
 int fun1(long long id)
@@ -43,18 +43,21 @@ int fun3(long long id)
 
 int main(int argc, char const *argv[])
 {
-    tp = new TimerPool;
+    tp = new Timer;
 
-    TimeEvent te = tp->getNearestTimer();
-    printf("nearest:%lld %lds %ldms\n", te.id, te.when_sec, te.when_ms);
+    const TimeEvent *te = tp->getNearestTimer();
+    if (te == nullptr)
+    {
+        printf("nearest:none\n");
+    }
 
     id1 = tp->createTimeEvent(1000, fun1);
     te = tp->getNearestTimer();
-    printf("nearest:%lld %lds %ldms\n", te.id, te.when_sec, te.when_ms);
+    printf("nearest:%lld %lldus\n", te->id, te->whenUs);
 
     id2 = tp->createTimeEvent(800, fun2);
     te = tp->getNearestTimer();
-    printf("nearest:%lld %lds %ldms\n", te.id, te.when_sec, te.when_ms);
+    printf("nearest:%lld %lldus\n", te->id, te->whenUs);
 
     tp->createTimeEvent(1000, fun3);
 
@@ -1,8 +1,10 @@
 #include "aes.hpp"
 #include <stdio.h>
+#include <string.h>
 #include <vector>
 
 #include "cryptor.h"
+#include "chacha20poly1305.h"
 
 std::vector<uint8_t> key = {0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
                             0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4};
@@ -43,15 +45,151 @@ void test(CRYPT_METHOD method)
     display(in, dlen);
 }
 
+bool check(const char *name, const char *what, const uint8_t *got, const uint8_t *want, uint32_t len)
+{
+    bool isOk = memcmp(got, want, len) == 0;
+    printf("%-20s %-12s %s\n", name, what, isOk ? "ok" : "FAIL");
+    if (!isOk)
+    {
+        display(const_cast<uint8_t *>(got), len);
+    }
+    return isOk;
+}
+
+struct AeadVector
+{
+    const char *name;
+    uint8_t key[32];
+    uint8_t nonce[12];
+    uint32_t length;
+    const uint8_t *plain;  // nullptr: byte i is i & 0xff
+    const uint8_t *cipher; // nullptr: only the tag is checked, it covers the cipher text
+    uint8_t tag[16];
+};
+
+// encrypt and decrypt with the Cryptor like a record, then a flipped tag bit must be refused
+bool testAead(CRYPT_METHOD method, const AeadVector &v)
+{
+    std::vector<uint8_t> plain(v.length);
+    for (uint32_t i = 0; i < v.length; i++)
+    {
+        plain[i] = v.plain ? v.plain[i] : i & 0xff;
+    }
+    uint8_t iv[AES_BLOCKLEN] = {0};
+    memcpy(iv, v.nonce, sizeof(v.nonce));
+
+    Cryptor cryptor(method, const_cast<uint8_t *>(v.key));
+    std::vector<uint8_t> buf(plain);
+    buf.resize(v.length + 16);
+    uint32_t len = cryptor.encrypt(iv, buf.data(), v.length);
+    bool isOk = len == v.length + 16;
+    if (v.cipher)
+    {
+        isOk &= check(v.name, "cipher", buf.data(), v.cipher, v.length);
+    }
+    isOk &= check(v.name, "tag", buf.data() + v.length, v.tag, 16);
+
+    std::vector<uint8_t> forged(buf);
+    isOk &= cryptor.decrypt(iv, buf.data(), len) == v.length;
+    isOk &= check(v.name, "plain", buf.data(), plain.data(), v.length);
+
+    forged[v.length + 15] ^= 0x01;
+    bool isRefused = cryptor.decrypt(iv, forged.data(), len) == DECRYPT_ERR;
+    printf("%-20s %-12s %s\n", v.name, "flipped tag", isRefused ? "refused" : "FAIL");
+    return isOk && isRefused;
+}
+
+// test cases 13 ~ 15 of the gcm spec, the AES-256 ones without aad. the long one is from openssl,
+// it goes through the 4 blocks ghash loop and a tail
+const uint8_t GCM_PLAIN_15[] = {
+    0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+    0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+    0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+    0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39, 0x1a, 0xaf, 0xd2, 0x55};
+const uint8_t GCM_CIPHER_15[] = {
+    0x52, 0x2d, 0xc1, 0xf0, 0x99, 0x56, 0x7d, 0x07, 0xf4, 0x7f, 0x37, 0xa3, 0x2a, 0x84, 0x42, 0x7d,
+    0x64, 0x3a, 0x8c, 0xdc, 0xbf, 0xe5, 0xc0, 0xc9, 0x75, 0x98, 0xa2, 0xbd, 0x25, 0x55, 0xd1, 0xaa,
+    0x8c, 0xb0, 0x8e, 0x48, 0x59, 0x0d, 0xbb, 0x3d, 0xa7, 0xb0, 0x8b, 0x10, 0x56, 0x82, 0x88, 0x38,
+    0xc5, 0xf6, 0x1e, 0x63, 0x93, 0xba, 0x7a, 0x0a, 0xbc, 0xc9, 0xf6, 0x62, 0x89, 0x80, 0x15, 0xad};
+const uint8_t GCM_ZERO_16[16] = {0};
+const uint8_t GCM_CIPHER_14[] = {
+    0xce, 0xa7, 0x40, 0x3d, 0x4d, 0x60, 0x6b, 0x6e, 0x07, 0x4e, 0xc5, 0xd3, 0xba, 0xf3, 0x9d, 0x18};
+#define GCM_KEY_15 {0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08, \
+                    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08}
+#define GCM_NONCE_15 {0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88}
+
+const AeadVector GCM_VECTORS[] = {
+    {"gcm test case 13", {0}, {0}, 0, nullptr, nullptr,
+     {0x53, 0x0f, 0x8a, 0xfb, 0xc7, 0x45, 0x36, 0xb9, 0xa9, 0x63, 0xb4, 0xf1, 0xc4, 0xcb, 0x73, 0x8b}},
+    {"gcm test case 14", {0}, {0}, 16, GCM_ZERO_16, GCM_CIPHER_14,
+     {0xd0, 0xd1, 0xc8, 0xa7, 0x99, 0x99, 0x6b, 0xf0, 0x26, 0x5b, 0x98, 0xb5, 0xd4, 0x8a, 0xb9, 0x19}},
+    {"gcm test case 15", GCM_KEY_15, GCM_NONCE_15, 64, GCM_PLAIN_15, GCM_CIPHER_15,
+     {0xb0, 0x94, 0xda, 0xc5, 0xd9, 0x34, 0x71, 0xbd, 0xec, 0x1a, 0x50, 0x22, 0x70, 0xe3, 0xcc, 0x6c}},
+    {"gcm 1000 bytes", GCM_KEY_15, GCM_NONCE_15, 1000, nullptr, nullptr,
+     {0x39, 0xe5, 0x08, 0x5c, 0xe7, 0x30, 0x90, 0xcd, 0x7a, 0xea, 0xe7, 0xf6, 0x26, 0x33, 0xb2, 0x04}},
+};
+
+int testGcm()
+{
+    if (!Cryptor::isSupported(CRYPT_GCM))
+    {
+        printf("gcm: no AES-NI or PCLMULQDQ, skipped\n");
+        return 0;
+    }
+    int failed = 0;
+    for (const AeadVector &v : GCM_VECTORS)
+    {
+        failed += !testAead(CRYPT_GCM, v);
+    }
+    return failed;
+}
+
+// the aead of rfc 8439 2.8.2 without its aad, records have none. the cipher text is the one of
+// the rfc, the tag is from openssl. the long one runs the 8 blocks avx2 kernel twice and a tail
+const char CHACHA_PLAIN_RFC[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+const uint8_t CHACHA_CIPHER_RFC[] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+    0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+    0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+    0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+    0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+    0x61, 0x16};
+#define CHACHA_KEY_RFC {0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, \
+                        0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f}
+#define CHACHA_NONCE_RFC {0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47}
+
+const AeadVector CHACHA_VECTORS[] = {
+    {"chacha rfc 2.8.2", CHACHA_KEY_RFC, CHACHA_NONCE_RFC, 114, (const uint8_t *) CHACHA_PLAIN_RFC, CHACHA_CIPHER_RFC,
+     {0x6a, 0x23, 0xa4, 0x68, 0x1f, 0xd5, 0x94, 0x56, 0xae, 0xa1, 0xd2, 0x9f, 0x82, 0x47, 0x72, 0x16}},
+    {"chacha 1124 bytes", CHACHA_KEY_RFC, CHACHA_NONCE_RFC, 1124, nullptr, nullptr,
+     {0x9a, 0xd9, 0x1b, 0x12, 0x9f, 0x21, 0x9c, 0x36, 0xd2, 0x5b, 0x81, 0xd9, 0x42, 0x3f, 0x3b, 0x5c}},
+};
+
+int testChacha()
+{
+    printf("chacha: %s\n", hasChachaAvx2() ? "avx2" : "portable");
+    int failed = 0;
+    for (const AeadVector &v : CHACHA_VECTORS)
+    {
+        failed += !testAead(CRYPT_CHACHA20_POLY1305, v);
+    }
+    return failed;
+}
+
 int main(int argc, char const *argv[])
 {
     test(CRYPT_CTR);
     printf("##########################\n");
     test(CRYPT_CBC);
+    printf("##########################\n");
+    int failed = testGcm();
+    failed += testChacha();
 
     uint8_t c[16];
     genRandomIv(c, 16);
     display(c, 16);
 
-    return 0;
+    return failed;
 }
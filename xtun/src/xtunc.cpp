@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 #include <csignal>
 #include <vector>
@@ -25,6 +26,10 @@ struct ConfigServer
     std::string password;
     std::string serverIp;
     std::string logPath;
+    IO_BACKEND ioBackend{IO_BACKEND_EPOLL};
+    bool isEdgeTriggered{false};
+    size_t recordSize{BUFFER_CHUNK_SIZE};
+    bool isPassthrough{false};
 } g_cfg;
 
 
@@ -65,6 +70,39 @@ void readConfig(const char *configFile)
         exit(-1);
     }
 
+    // optional, epoll(default), io_uring or select
+    string ioBackend;
+    iniFile.GetStringValueOrDefault(common, "io_backend", &ioBackend, "epoll");
+    if (ioBackend == "io_uring")
+    {
+        g_cfg.ioBackend = IO_BACKEND_IO_URING;
+    }
+    else if (ioBackend == "select")
+    {
+        g_cfg.ioBackend = IO_BACKEND_SELECT;
+    }
+
+    // optional, edge triggered epoll, 0(default) or 1
+    int edgeTriggered;
+    iniFile.GetIntValueOrDefault(common, "edge_triggered", &edgeTriggered, 0);
+    g_cfg.isEdgeTriggered = edgeTriggered != 0;
+
+    // optional, max bytes of an encrypted record, 1024 ~ 65536(default)
+    int recordSize;
+    iniFile.GetIntValueOrDefault(common, "record_size", &recordSize, BUFFER_CHUNK_SIZE);
+    if (recordSize < static_cast<int>(MIN_RECORD_SIZE) || recordSize > static_cast<int>(BUFFER_CHUNK_SIZE))
+    {
+        int clamped = std::min(std::max(recordSize, static_cast<int>(MIN_RECORD_SIZE)), static_cast<int>(BUFFER_CHUNK_SIZE));
+        printf("record_size %d is out of %lu ~ %lu, %d is used\n", recordSize, MIN_RECORD_SIZE, BUFFER_CHUNK_SIZE, clamped);
+        recordSize = clamped;
+    }
+    g_cfg.recordSize = recordSize;
+
+    // optional, encrypted(default) or none: user data skips the tunnel and is spliced as it is, trusted networks only
+    string cipher;
+    iniFile.GetStringValueOrDefault(common, "cipher", &cipher, "encrypted");
+    g_cfg.isPassthrough = cipher == "none";
+
     g_cfg.password = password;
     g_cfg.serverIp = serverIp;
     g_cfg.serverPort = serverPort;
@@ -72,7 +110,7 @@ void readConfig(const char *configFile)
 
     std::vector<string> sections;
     int num = iniFile.GetSections(&sections);
-    int localPort, remotePort;
+    int localPort, remotePort, weight;
     std::string localIp;
     for (int i = 0; i < num; i++)
     {
@@ -82,10 +120,13 @@ void readConfig(const char *configFile)
             iniFile.GetStringValue(sections[i], "local_ip", &localIp);
             iniFile.GetIntValue(sections[i], "remote_port", &remotePort);
             iniFile.GetIntValue(sections[i], "local_port", &localPort);
+            // optional, share of the tunnel when proxies are busy at the same time
+            iniFile.GetIntValueOrDefault(sections[i], "weight", &weight, 1);
 
             strcpy(pi.localIp, localIp.c_str());
             pi.remotePort = remotePort;
             pi.localPort = localPort;
+            pi.weight = std::min(std::max(weight, 1), static_cast<int>(MAX_PROXY_WEIGHT));
             pcs.push_back(pi);
             printf("---%s\n", sections[i].c_str());
         }
@@ -158,6 +199,9 @@ int main(int argc, char *argv[])
     logger->warn("---------------------");
     logger->err("---------------------");
 
+    Reactor::setIoBackend(g_cfg.ioBackend);
+    Reactor::setEdgeTriggered(g_cfg.isEdgeTriggered);
+    FrameBatcher::setMaxRecordSize(g_cfg.recordSize);
     g_pClient = std::make_unique<Client>(logger, g_cfg.serverIp.c_str(), g_cfg.serverPort);
     if (g_pClient == nullptr)
     {
@@ -168,6 +212,7 @@ int main(int argc, char *argv[])
 
     g_pClient->setProxyConfig(pcs);
     g_pClient->setPassword(g_cfg.password.c_str());
+    g_pClient->setPassthrough(g_cfg.isPassthrough);
 
     size_t retryCnt = 0, sleepSec;
     while (true)
@@ -1,6 +1,7 @@
 #include <string>
 #include <csignal>
 #include <memory>
+#include <thread>
 
 #include "server.h"
 #include "inifile.h"
@@ -19,6 +20,11 @@ struct ConfigServer
     unsigned short serverPort{};
     std::string password;
     std::string logPath;
+    IO_BACKEND ioBackend{IO_BACKEND_EPOLL};
+    bool isEdgeTriggered{false};
+    size_t threadNum{1};
+    size_t recordSize{BUFFER_CHUNK_SIZE};
+    bool isPassthrough{false};
 } g_cfg;
 
 
@@ -53,9 +59,51 @@ void readConfig(const char *cfgFile)
         exit(-1);
     }
 
+    // optional, 0 means one reactor thread per core
+    int threadNum;
+    iniFile.GetIntValueOrDefault(common, "thread_num", &threadNum, 1);
+    if (threadNum <= 0)
+    {
+        threadNum = std::thread::hardware_concurrency();
+    }
+
+    // optional, epoll(default), io_uring or select
+    string ioBackend;
+    iniFile.GetStringValueOrDefault(common, "io_backend", &ioBackend, "epoll");
+    if (ioBackend == "io_uring")
+    {
+        g_cfg.ioBackend = IO_BACKEND_IO_URING;
+    }
+    else if (ioBackend == "select")
+    {
+        g_cfg.ioBackend = IO_BACKEND_SELECT;
+    }
+
+    // optional, edge triggered epoll, 0(default) or 1
+    int edgeTriggered;
+    iniFile.GetIntValueOrDefault(common, "edge_triggered", &edgeTriggered, 0);
+    g_cfg.isEdgeTriggered = edgeTriggered != 0;
+
+    // optional, max bytes of an encrypted record, 1024 ~ 65536(default)
+    int recordSize;
+    iniFile.GetIntValueOrDefault(common, "record_size", &recordSize, BUFFER_CHUNK_SIZE);
+    if (recordSize < static_cast<int>(MIN_RECORD_SIZE) || recordSize > static_cast<int>(BUFFER_CHUNK_SIZE))
+    {
+        int clamped = std::min(std::max(recordSize, static_cast<int>(MIN_RECORD_SIZE)), static_cast<int>(BUFFER_CHUNK_SIZE));
+        printf("record_size %d is out of %lu ~ %lu, %d is used\n", recordSize, MIN_RECORD_SIZE, BUFFER_CHUNK_SIZE, clamped);
+        recordSize = clamped;
+    }
+    g_cfg.recordSize = recordSize;
+
+    // optional, encrypted(default) or none: user data skips the tunnel and is spliced as it is, trusted networks only
+    string cipher;
+    iniFile.GetStringValueOrDefault(common, "cipher", &cipher, "encrypted");
+    g_cfg.isPassthrough = cipher == "none";
+
     g_cfg.password = password;
     g_cfg.serverPort = serverPort;
     g_cfg.logPath = logPath;
+    g_cfg.threadNum = threadNum;
     //printf("pw:%s\nsp: %d\npp: %d\n", g_cfg.password.c_str(), g_cfg.serverPort, g_cfg.proxyPort);
 }
 
@@ -127,8 +175,13 @@ int main(int argc, char *argv[])
     logger->warn("-------------------------");
     logger->err("-------------------------");
 
+    Reactor::setIoBackend(g_cfg.ioBackend);
+    Reactor::setEdgeTriggered(g_cfg.isEdgeTriggered);
+    FrameBatcher::setMaxRecordSize(g_cfg.recordSize);
     g_pServer = std::make_unique<Server>(logger, g_cfg.serverPort);
     g_pServer->setPassword(g_cfg.password.c_str());
+    g_pServer->setThreadNum(g_cfg.threadNum);
+    g_pServer->setPassthrough(g_cfg.isPassthrough);
     g_pServer->startEventLoop();
 
     return 0;